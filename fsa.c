@@ -1,17 +1,61 @@
+// pread, posix_memalign, strdup, lstat, syscall and MAP_POPULATE
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sched.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
+// Compressed input support is opt-in: build with -DFSA_WITH_ZLIB -lz
+// and/or -DFSA_WITH_ZSTD -lzstd
+#ifdef FSA_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef FSA_WITH_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define FSA_HAVE_IO_URING 1
+#endif
+#endif
 
 #define MAX_STATES 100
 #define MAX_TRANSITIONS 500
 #define EPSILON '\0'
+#define NO_TAG -1
+#define MAX_CAPTURE_SLOTS 32
 
-// Structure to represent a transition
+// Structure to represent a transition. An epsilon transition may carry a
+// tag: the capture slot that records the input position when it is taken.
 typedef struct {
     int from_state;
     int to_state;
     char symbol;
+    int tag;
 } Transition;
 
 // Structure to represent the FSA
@@ -30,10 +74,695 @@ typedef struct {
     int size;
 } StateSet;
 
+// Matching engines, used to tag latency samples
+typedef enum {
+    ENGINE_NFA,
+    ENGINE_DFA,
+    ENGINE_BIT_PARALLEL,
+    ENGINE_LAZY_DFA,
+    NUM_ENGINES
+} Engine;
+
+static const char *engine_names[NUM_ENGINES] = {"nfa", "dfa", "bit-parallel", "lazy-dfa"};
+
+// Outcome of a budgeted match
+typedef enum {
+    MATCH_REJECT,
+    MATCH_ACCEPT,
+    MATCH_BUDGET_EXCEEDED
+} MatchStatus;
+
+// Marks a missing transition in intermediate tables
+#define DFA_DEAD -1
+
+// Table-driven DFA compiled from a deterministic FSA. State ids are row
+// offsets premultiplied by 256, so table[state + byte] is the next state.
+// Rows are laid out as ordinary states, then the dead state (which loops
+// to itself), then accepting states: any id >= dead is special, and the
+// inner loop is one load and one compare.
+typedef struct {
+    int num_states;
+    int start;
+    int dead;
+    int accept_min;
+    int *table;
+    uint64_t version;
+} CompiledDFA;
+
+// Set of NFA states as a 128-bit mask (state ids are below MAX_STATES)
+typedef struct {
+    uint64_t w[2];
+} StateBits;
+_Static_assert(MAX_STATES <= 128, "StateBits holds at most 128 states");
+
+// NFA with epsilon moves folded into its edges, for bitset simulation.
+// Edges are grouped by symbol: edges edge_start[c] .. edge_start[c + 1] - 1
+// read byte c, leave edge_from and reach the closure in edge_to.
+typedef struct {
+    StateBits start;
+    StateBits accepting;
+    int edge_start[257];
+    int edge_from[MAX_TRANSITIONS];
+    StateBits edge_to[MAX_TRANSITIONS];
+} BitNFA;
+
+// DFA built on demand from a BitNFA, holding at most LAZY_CACHE_STATES
+// subsets. When it fills up the whole cache is flushed and rebuilt.
+#define LAZY_CACHE_STATES 64
+#define LAZY_HASH_SLOTS (LAZY_CACHE_STATES * 2)
+#define LAZY_UNKNOWN -2
+typedef struct {
+    BitNFA *nfa;
+    StateBits sets[LAZY_CACHE_STATES];
+    bool accepting[LAZY_CACHE_STATES];
+    int next[LAZY_CACHE_STATES][256];
+    int slots[LAZY_HASH_SLOTS];
+    int num_states;
+    int start;
+    uint64_t flushes;
+    uint64_t bytes;
+} LazyDFA;
+
+// Shape of an automaton, used to pick a matching engine
+typedef struct {
+    int num_states;
+    int num_transitions;
+    double epsilon_density;
+    int estimated_dfa_states;
+} AutomatonStats;
+
+// Cheap invariants of an automaton's language, used to reject inputs
+// before any engine runs. Byte sets are 256-bit masks.
+typedef struct {
+    bool empty;
+    size_t min_length;
+    size_t max_length;
+    uint64_t first[4];
+    uint64_t last[4];
+    uint64_t required[4];
+    uint64_t forbidden[4];
+#ifdef __SSSE3__
+    // forbidden split for the SSSE3 test: bit h of highclear[lo] is byte
+    // (h << 4 | lo), bit h of highset[lo] is byte (0x80 | h << 4 | lo)
+    unsigned char forbidden_highclear[16];
+    unsigned char forbidden_highset[16];
+#endif
+} LanguageSummary;
+
+#define SUMMARY_UNBOUNDED SIZE_MAX
+
+// Switch away from the lazy DFA once it has flushed a few times and
+// averages fewer input bytes than this between flushes
+#define LAZY_THRASH_MIN_FLUSHES 4
+#define LAZY_THRASH_BYTES_PER_FLUSH 4096
+
+// Meta-engine that picks the cheapest engine for an automaton and falls
+// back at runtime when the lazy DFA thrashes. Not thread-safe: the lazy
+// DFA cache is updated while matching, so use one Matcher per thread.
+typedef struct {
+    FSA *fsa;
+    Engine engine;
+    AutomatonStats stats;
+    LanguageSummary summary;
+    BitNFA *bits;
+    LazyDFA *lazy;
+    CompiledDFA *compiled;
+} Matcher;
+
+// Engine callback used by the result cache
+typedef bool (*MatchFunction)(void *automaton, const char *input);
+
+// Result cache in front of any engine. Entries are keyed by input hash and
+// automaton version and live in 8-way sets with CLOCK eviction inside each
+// set; sets are guarded by a fixed number of striped locks.
+#define CACHE_WAYS 8
+#define CACHE_STRIPES 64
+typedef struct {
+    uint64_t hash;
+    uint64_t version;
+    char *input;
+    size_t length;
+    bool result;
+    bool referenced;
+} CacheEntry;
+
+typedef struct {
+    int num_sets;
+    CacheEntry *entries;
+    unsigned char *hands;
+    pthread_mutex_t locks[CACHE_STRIPES];
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t evictions;
+} MatchCache;
+
+// One-pass DFA for capture extraction. Its states are the NFA's start
+// state and the targets of symbol transitions; each table entry stores the
+// next state and the capture slots to set to the current position before
+// the byte is consumed.
+#define ONEPASS_DEAD -1
+typedef struct {
+    int next;
+    uint32_t slots;
+} OnePassEdge;
+
+typedef struct {
+    int num_states;
+    int start;
+    int num_slots;
+    OnePassEdge *table;
+    bool *accepting;
+    uint32_t *accept_slots;
+} OnePassDFA;
+
+// Generating function of a DFA's accepted-string counts modulo a prime:
+// sum over n of count(n) x^n = numerator(x) / denominator(x), with
+// denominator[0] = 1. Equivalently count(n) = -sum denominator[j] count(n-j)
+// for n >= order.
+typedef struct {
+    int order;
+    uint64_t modulus;
+    uint64_t numerator[MAX_STATES + 2];
+    uint64_t denominator[MAX_STATES + 2];
+} CountGenerating;
+
+// Lazy enumeration of accepted strings in length-lexicographic order over
+// a compiled DFA. finish[r] holds the DFA rows that can reach acceptance
+// in exactly r more bytes; it is extended one level per length, and the
+// depth-first walk only enters rows that can still finish in time.
+typedef struct {
+    CompiledDFA *dfa;
+    size_t max_length;
+    size_t length;
+    long depth;
+    size_t capacity;
+    StateBits *finish;
+    int *states;
+    int *next_byte;
+    char *path;
+    bool failed;
+} WitnessIterator;
+
+// Uniform sampler of accepted strings of one length. weights[r * rows + row]
+// is proportional to the number of accepted strings of length r starting
+// at that DFA row; each level is scaled so its largest entry is 1, which
+// keeps the doubles in range and leaves the ratios within a level intact.
+typedef struct {
+    CompiledDFA *dfa;
+    size_t length;
+    double *weights;
+} Sampler;
+
+// Semirings for weighted automata. Tropical is (min, +) over costs; log
+// is (-log(e^-a + e^-b), +) over negative log probabilities; probability
+// is (+, *).
+typedef enum {
+    SEMIRING_TROPICAL,
+    SEMIRING_LOG,
+    SEMIRING_PROBABILITY
+} Semiring;
+
+// Weighted FSA: the base FSA holds the structure (epsilon transitions are
+// not supported), weights[i] is the weight of base.transitions[i], and
+// accepting states carry a final weight. weightedCompile groups the edges
+// by symbol into CSR arrays for the forward pass.
+typedef struct {
+    FSA base;
+    Semiring semiring;
+    double weights[MAX_TRANSITIONS];
+    double final_weight[MAX_STATES];
+    bool compiled;
+    int edge_start[257];
+    int edge_from[MAX_TRANSITIONS];
+    int edge_to[MAX_TRANSITIONS];
+    double edge_weight[MAX_TRANSITIONS];
+} WeightedFSA;
+
+#define TRANSDUCER_MAX_HOLD 256
+#define NO_OUTPUT -1
+
+// Transducer edge. On a byte the stream appends it to its pending bytes,
+// writes out the first `release` of them, and then, if output is set,
+// drops the rest and writes outputs[output] in their place.
+typedef struct {
+    int32_t next;
+    uint16_t release;
+    int16_t output;
+} TransducerEdge;
+
+// Deterministic Mealy transducer, table indexed by state * 256 + byte.
+// State 0 is the start state and holds no pending bytes; passthrough[c]
+// marks the bytes that are copied straight through from it.
+typedef struct {
+    int num_states;
+    TransducerEdge *table;
+    int num_outputs;
+    char **outputs;
+    size_t *output_lengths;
+    size_t max_output;
+    bool passthrough[256];
+} Transducer;
+
+// Streaming state of a transducer: the current state and the bytes held
+// back while a partial match is in progress.
+typedef struct {
+    Transducer *transducer;
+    int state;
+    size_t held;
+    char pending[TRANSDUCER_MAX_HOLD];
+} TransducerStream;
+
+// Sliding-window matcher: reports when a match of the compiled DFA ends
+// at the current byte and starts within the last `window` bytes. Every
+// offset starts a run; runs that reach the same DFA state are merged,
+// keeping the latest start. Active states are kept in a dense list with
+// latest[] aligned to it, and slot[row] is a state's index in it or -1.
+typedef struct {
+    CompiledDFA *dfa;
+    size_t window;
+    uint64_t offset;
+    int count;
+    int *states;
+    uint64_t *latest;
+    int *next_states;
+    uint64_t *next_latest;
+    int *slot;
+} WindowMatcher;
+
+// Symbol partition of a visibly pushdown automaton: calls push, returns
+// pop, internal symbols leave the stack alone
+typedef enum {
+    SYMBOL_INTERNAL,
+    SYMBOL_CALL,
+    SYMBOL_RETURN
+} SymbolKind;
+
+typedef struct {
+    int from_state;
+    int to_state;
+    char symbol;
+    int push;
+} CallTransition;
+
+typedef struct {
+    int from_state;
+    int to_state;
+    char symbol;
+    int pop;
+} ReturnTransition;
+
+// Visibly pushdown automaton. base holds the states and the internal
+// transitions; calls push a stack symbol and returns pop one. A word is
+// accepted when it is well nested and ends in an accepting state.
+typedef struct {
+    FSA base;
+    SymbolKind kinds[256];
+    int num_calls;
+    CallTransition calls[MAX_TRANSITIONS];
+    int num_returns;
+    ReturnTransition returns[MAX_TRANSITIONS];
+} VPA;
+
+#define VPA_MAX_DEPTH 128
+#define VPA_CACHE_STATES 256
+#define VPA_RETURN_SLOTS 4096
+#define VPA_REJECTED -1
+
+// State of the determinized VPA: for each entry state p (the start state,
+// or a state entered by the innermost open call) the states reachable
+// from p since that call
+typedef struct {
+    StateBits entries;
+    StateBits reach[MAX_STATES];
+    uint64_t hash;
+} VPASummary;
+
+typedef struct {
+    int current;
+    int caller;
+    unsigned char call;
+    unsigned char symbol;
+    int next;
+} VPAReturnSlot;
+
+// Streaming matcher that determinizes the VPA lazily. Summaries are
+// interned in a cache; internal and call moves are cached per summary and
+// byte, return moves in a hash keyed by the summary pair and both
+// symbols. The stack holds summary ids and call bytes, so a full cache is
+// compacted down to the summaries still referenced instead of flushed.
+typedef struct {
+    VPA *vpa;
+    VPASummary *summaries;
+    int num_summaries;
+    int *next;
+    VPAReturnSlot *return_slots;
+    int initial;
+    int state;
+    int depth;
+    int stack[VPA_MAX_DEPTH];
+    unsigned char stack_calls[VPA_MAX_DEPTH];
+    bool overflow;
+    uint64_t compactions;
+} VPAMatcher;
+
+// Options for ingestFiles. Reads are chunk_size bytes (rounded up to
+// INGEST_ALIGN) with up to queue_depth of them in flight per thread.
+// direct opens the files with O_DIRECT; synchronous skips io_uring.
+#define INGEST_ALIGN 4096
+typedef struct {
+    size_t chunk_size;
+    int queue_depth;
+    int threads;
+    bool direct;
+    bool synchronous;
+} IngestOptions;
+
+// Per-file outcome of ingestFiles. Records are lines; a record matches
+// when the whole line is accepted. error is the errno of a failed open or
+// read, 0 otherwise.
+typedef struct {
+    const char *path;
+    uint64_t bytes;
+    uint64_t records;
+    uint64_t matches;
+    int error;
+} IngestResult;
+
+// Buffer descriptor passed between pipeline stages, e.g. decompressed
+// data handed from a decompressor thread to its matcher. end marks the
+// last block of a file, with error set if it failed.
+#define DECOMPRESS_BLOCK_SIZE (256 * 1024)
+#define BLOCK_QUEUE_DEPTH 8
+typedef struct {
+    char *data;
+    size_t length;
+    int file;
+    int error;
+    bool end;
+} Block;
+
+// How a ring operation waits: spin (lowest latency, burns a core) or
+// spin briefly and then sleep until the other side makes progress
+typedef enum {
+    WAIT_SPIN,
+    WAIT_BLOCK
+} WaitPolicy;
+
+#define RING_SPIN_LIMIT 256
+
+typedef struct {
+    WaitPolicy policy;
+    atomic_int sleepers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} RingWaiter;
+
+typedef enum {
+    RING_SPSC,
+    RING_MPMC
+} RingKind;
+
+// Bounded lock-free ring of blocks. SPSC rings are Lamport queues where
+// each side caches the other's index; MPMC rings are Vyukov queues with a
+// sequence number per slot. head is the consumer side (dequeue position),
+// tail the producer side, each on its own cache line. Once closed, pushes
+// fail and pops drain what is left.
+typedef struct {
+    RingKind kind;
+    size_t mask;
+    Block *slots;
+    atomic_size_t *sequences;
+    _Alignas(64) atomic_size_t head;
+    size_t cached_tail;
+    _Alignas(64) atomic_size_t tail;
+    size_t cached_head;
+    _Alignas(64) RingWaiter not_empty;
+    RingWaiter not_full;
+    atomic_bool closed;
+} BlockRing;
+
+// Pipeline stage: transforms a block in place and returns true to pass it
+// on, or false if it took the block out of the pipeline
+typedef bool (*StageFunction)(void *context, Block *block);
+
+#define MAX_PIPELINE_STAGES 8
+
+typedef struct {
+    StageFunction function;
+    void *context;
+    int threads;
+    atomic_int running;
+    atomic_ullong items;
+    atomic_ullong bytes;
+    atomic_ullong busy_ns;
+} PipelineStage;
+
+// Chain of stages joined by bounded rings: rings[i] feeds stage i and
+// rings[num_stages] is the output. A full ring stalls the stage before
+// it, so backpressure reaches the source. A ring is SPSC when a single
+// thread sits on each side of it and MPMC otherwise.
+typedef struct {
+    size_t ring_capacity;
+    WaitPolicy policy;
+    int num_stages;
+    PipelineStage stages[MAX_PIPELINE_STAGES];
+    BlockRing *rings[MAX_PIPELINE_STAGES + 1];
+    pthread_t *threads;
+    int num_threads;
+    bool started;
+} Pipeline;
+
+// Options for scanDirectory. Files larger than chunk_size are split into
+// chunks of that many bytes, each owning the lines that start in it.
+// lines reports every matching line instead of one entry per file.
+typedef struct {
+    int threads;
+    size_t chunk_size;
+    bool lines;
+} ScanOptions;
+
+// One entry of a scan report. In lines mode line is the 1-based line
+// number and text the line without its newline; otherwise line is 0 and
+// count the number of matching lines. A file or directory that could not
+// be read gets an entry with error set.
+typedef struct {
+    char *path;
+    uint64_t line;
+    uint64_t count;
+    char *text;
+    int error;
+} ScanMatch;
+
+typedef struct {
+    ScanMatch *matches;
+    size_t count;
+    uint64_t files;
+    uint64_t bytes;
+} ScanReport;
+
+#ifdef __linux__
+// Wire protocol of the matching daemon, all integers little-endian.
+// Request: u32 id, u16 automaton index, u32 input length, input bytes.
+// Reply: u32 id, u8 ReplyStatus. Replies on a connection come back in
+// request order, so clients can pipeline, but each connection buffers at
+// most SERVER_IN_LIMIT bytes of requests and stops taking requests while
+// SERVER_OUT_LIMIT bytes of replies are unread: a client must read its
+// replies as it sends.
+#define SERVER_REQUEST_HEADER 10
+#define SERVER_REPLY_SIZE 5
+#define SERVER_MAX_INPUT (1 << 20)
+#define SERVER_IN_LIMIT (2 << 20)
+#define SERVER_OUT_LIMIT (64 * 1024)
+#define SERVER_MAX_BATCH 1024
+#define SERVER_SLICE 64
+typedef enum {
+    REPLY_REJECT,
+    REPLY_ACCEPT,
+    REPLY_ERROR
+} ReplyStatus;
+
+typedef struct {
+    int fd;
+    char *in;
+    size_t in_length;
+    size_t in_capacity;
+    char *out;
+    size_t out_length;
+    size_t out_capacity;
+    uint32_t events;
+    bool closing;
+} ServerConnection;
+
+// A request taken into the current batch; input is an offset into the
+// batch arena, where it is stored NUL-terminated
+typedef struct {
+    ServerConnection *connection;
+    uint32_t id;
+    int automaton;
+    size_t input;
+    ReplyStatus reply;
+} ServerRequest;
+
+// Run of requests for one automaton, matched with one batch call
+typedef struct {
+    int automaton;
+    int begin;
+    int end;
+} ServerSlice;
+
+// Daemon serving compiled automata over a Unix socket. One thread runs
+// the epoll loop: it reads requests from every ready connection, gathers
+// them into a batch, has the worker pool match the batch in per-automaton
+// slices with acceptsBatchShared, then writes the replies.
+typedef struct {
+    char *socket_path;
+    bool bound;
+    CompiledDFA **automata;
+    int num_automata;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;
+    pthread_t loop;
+
+    ServerConnection **connections;
+    int num_connections;
+    int connections_capacity;
+
+    ServerRequest *requests;
+    int num_requests;
+    char *arena;
+    size_t arena_length;
+    size_t arena_capacity;
+    const char **inputs;
+    bool *results;
+    ServerSlice *slices;
+    int num_slices;
+
+    int num_workers;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    uint64_t generation;
+    int next_slice;
+    int slices_left;
+    bool stopping;
+
+    atomic_ullong served;
+    atomic_ullong batches;
+} MatchServer;
+
+typedef struct {
+    int fd;
+    uint32_t next_id;
+} MatchClient;
+
+// A stream's matcher as a resumable task. All of its state is here (the
+// read buffer belongs to the worker running it), so a suspended stream
+// costs one of these and an epoll registration.
+typedef struct StreamTask {
+    int fd;
+    int dfa_state;
+    bool open_record;
+    bool in_use;
+    uint64_t id;
+    uint64_t records;
+    uint64_t matches;
+    struct StreamTask *next_free;
+} StreamTask;
+
+typedef void (*StreamMatchCallback)(void *context, uint64_t stream, uint64_t record);
+typedef void (*StreamCloseCallback)(void *context, uint64_t stream, uint64_t records, uint64_t matches, int error);
+
+#define TASK_SLAB 256
+#define TASK_QUANTUM (64 * 1024)
+
+// Runs line matching over many nonblocking streams on a few worker
+// threads. A task resumes when its fd is readable, reads and matches
+// until the fd would block, then suspends by re-arming its one-shot epoll
+// registration. A task that has read TASK_QUANTUM bytes yields so one busy
+// stream cannot starve the rest. Tasks come from slabs with a free list.
+typedef struct {
+    CompiledDFA *dfa;
+    StreamMatchCallback on_match;
+    StreamCloseCallback on_close;
+    void *context;
+    int epoll_fd;
+    int wake_fd;
+    int num_workers;
+    pthread_t *workers;
+    pthread_mutex_t pool_lock;
+    StreamTask **slabs;
+    int num_slabs;
+    StreamTask *free_tasks;
+    atomic_long active;
+} StreamScheduler;
+#endif
+
+// Incremental matcher over a stream fed in chunks. Runs the compiled DFA
+// when one is given, otherwise tracks the NFA's active state set.
+typedef struct {
+    FSA *fsa;
+    CompiledDFA *compiled;
+    uint64_t version;
+    uint64_t offset;
+    int dfa_state;
+    StateSet active;
+} StreamMatcher;
+
+// Several compiled DFAs advanced in lockstep over one input pass. Their
+// tables are concatenated and rebased, and every dead state loops to
+// itself, so the inner loop is a single load per automaton per byte.
+typedef struct {
+    int count;
+    int *table;
+    int *starts;
+    int *states;
+    int *accept_min;
+    int *accept_max;
+} ScanGroup;
+
+// A multi-pattern automaton split into separately determinized shards,
+// each matched on its own thread
+#define MAX_SHARDS 64
+typedef struct {
+    int num_shards;
+    CompiledDFA *shards[MAX_SHARDS];
+} ShardSet;
+
+// A stream prefix ending at offset is accepted by the given shard
+typedef struct {
+    uint64_t offset;
+    int shard;
+} MatchEvent;
+
+#define CHECKPOINT_MAGIC "FSM1"
+#define CHECKPOINT_BITMAP_BYTES ((MAX_STATES + 7) / 8)
+// magic, mode, version, offset, then a DFA state id or an NFA state bitmap
+#define CHECKPOINT_MAX_SIZE (4 + 1 + 8 + 8 + CHECKPOINT_BITMAP_BYTES)
+
+// Latency histogram layout: values below 2^SUB_BUCKET_BITS ns get exact
+// buckets, every larger power of two is split into SUB_BUCKETS linear
+// buckets (about 6% relative error), up to roughly 2^40 ns.
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAGNITUDES 36
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS * (LATENCY_MAGNITUDES + 1))
+// Input lengths are bucketed by power of two: 0, 1, 2-3, 4-7, ...
+#define LATENCY_LENGTH_CLASSES 16
+
+// HDR-style latency histogram in nanoseconds
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max_ns;
+} LatencyHistogram;
+
 // Function prototypes
 void initFSA(FSA *fsa);
 void addState(FSA *fsa, int state, bool is_start, bool is_accepting);
 void addTransition(FSA *fsa, int from, int to, char symbol);
+void addCaptureTransition(FSA *fsa, int from, int to, int slot);
 bool accepts(FSA *fsa, const char *input);
 StateSet closure(FSA *fsa, int state);
 StateSet closureSet(FSA *fsa, StateSet *states);
@@ -46,6 +775,123 @@ bool stateSetContains(StateSet *set, int state);
 void addToStateSet(StateSet *set, int state);
 bool stateSetEqual(StateSet *s1, StateSet *s2);
 void copyStateSet(StateSet *dest, StateSet *src);
+CompiledDFA* compileDFA(FSA *dfa);
+void freeCompiledDFA(CompiledDFA *dfa);
+bool acceptsCompiled(CompiledDFA *dfa, const char *input);
+void acceptsBatchShared(CompiledDFA *dfa, const char **inputs, int count, bool *results);
+MatchStatus acceptsBudgeted(FSA *fsa, CompiledDFA *compiled, const char *input, long budget);
+uint64_t fsaVersion(FSA *fsa);
+void streamInit(StreamMatcher *m, FSA *fsa, CompiledDFA *compiled);
+void streamFeed(StreamMatcher *m, const char *data, size_t length);
+bool streamAccepting(StreamMatcher *m);
+size_t streamCheckpoint(StreamMatcher *m, unsigned char *buf, size_t capacity);
+bool streamRestore(StreamMatcher *m, const unsigned char *buf, size_t length);
+ScanGroup* scanGroupCreate(CompiledDFA **dfas, int count);
+void scanGroupReset(ScanGroup *group);
+void scanGroupFeed(ScanGroup *group, const char *data, size_t length);
+bool scanGroupAccepting(ScanGroup *group, int index);
+void freeScanGroup(ScanGroup *group);
+ShardSet* shardAutomaton(FSA *fsa, int num_shards);
+size_t shardScan(ShardSet *set, const char *data, size_t length, MatchEvent **events);
+void freeShardSet(ShardSet *set);
+void buildBitNFA(FSA *fsa, BitNFA *nfa);
+bool acceptsBitParallel(BitNFA *nfa, const char *input);
+void acceptsBitSliced(BitNFA *nfa, const char **inputs, int count, bool *results);
+void initLazyDFA(LazyDFA *lazy, BitNFA *nfa);
+bool acceptsLazy(LazyDFA *lazy, const char *input);
+void automatonStats(FSA *fsa, BitNFA *nfa, AutomatonStats *stats);
+void summarizeLanguage(BitNFA *nfa, LanguageSummary *summary);
+bool summaryMayAccept(LanguageSummary *summary, const char *input, size_t length);
+Matcher* matcherCreate(FSA *fsa);
+bool matcherAccepts(Matcher *m, const char *input);
+void freeMatcher(Matcher *m);
+MatchCache* matchCacheCreate(int capacity);
+bool cachedAccepts(MatchCache *cache, MatchFunction match, void *automaton,
+                   uint64_t version, const char *input);
+void matchCacheStats(MatchCache *cache, uint64_t *hits, uint64_t *misses, uint64_t *evictions);
+void freeMatchCache(MatchCache *cache);
+bool matchWithFSA(void *fsa, const char *input);
+bool matchWithCompiled(void *dfa, const char *input);
+bool matchWithMatcher(void *m, const char *input);
+OnePassDFA* buildOnePass(FSA *fsa);
+bool onePassCaptures(OnePassDFA *dfa, const char *input, long *slots);
+void freeOnePass(OnePassDFA *dfa);
+uint64_t countAcceptedMod(CompiledDFA *dfa, uint64_t n, uint64_t modulus);
+char* countAccepted(CompiledDFA *dfa, uint64_t n);
+bool countGeneratingFunction(CompiledDFA *dfa, uint64_t prime, CountGenerating *gf);
+void countAcceptedUpTo(CountGenerating *gf, int max_length, uint64_t *counts);
+long shortestAccepted(CompiledDFA *dfa, char *buf, size_t capacity);
+WitnessIterator* witnessIterCreate(CompiledDFA *dfa, size_t max_length);
+long witnessIterNext(WitnessIterator *it, char *buf, size_t capacity);
+void freeWitnessIter(WitnessIterator *it);
+Sampler* samplerCreate(CompiledDFA *dfa, size_t length);
+bool samplerDraw(Sampler *sampler, uint64_t *rng, char *buf);
+size_t samplerBulk(Sampler *sampler, size_t count, int threads, uint64_t seed, char *out);
+void freeSampler(Sampler *sampler);
+void initWeightedFSA(WeightedFSA *wfsa, Semiring semiring);
+void addWeightedTransition(WeightedFSA *wfsa, int from, int to, char symbol, double weight);
+void setFinalWeight(WeightedFSA *wfsa, int state, double weight);
+bool weightedCompile(WeightedFSA *wfsa);
+double weightedScore(WeightedFSA *wfsa, const char *input);
+WeightedFSA* weightedDeterminize(WeightedFSA *wfsa);
+Transducer* redactionTransducer(const char **patterns, const char **replacements, int count);
+void transducerInit(TransducerStream *stream, Transducer *transducer);
+size_t transducerOutputBound(TransducerStream *stream, size_t length);
+long transducerFeed(TransducerStream *stream, const char *input, size_t length, char *out, size_t capacity);
+long transducerFinish(TransducerStream *stream, char *out, size_t capacity);
+void freeTransducer(Transducer *transducer);
+WindowMatcher* windowMatcherCreate(CompiledDFA *dfa, size_t window);
+void windowMatcherReset(WindowMatcher *wm);
+long windowStep(WindowMatcher *wm, unsigned char c);
+size_t windowFeed(WindowMatcher *wm, const char *input, size_t length, uint64_t *last_end);
+void freeWindowMatcher(WindowMatcher *wm);
+void initVPA(VPA *vpa);
+void setSymbolKind(VPA *vpa, char symbol, SymbolKind kind);
+void addCallTransition(VPA *vpa, int from, int to, char symbol, int push);
+void addReturnTransition(VPA *vpa, int from, int to, char symbol, int pop);
+VPAMatcher* vpaMatcherCreate(VPA *vpa);
+void vpaMatcherReset(VPAMatcher *m);
+bool vpaFeed(VPAMatcher *m, const char *input, size_t length);
+bool vpaAccepting(VPAMatcher *m);
+bool vpaAccepts(VPA *vpa, const char *input);
+void freeVPAMatcher(VPAMatcher *m);
+int ingestFiles(CompiledDFA *dfa, const char **paths, int count, const IngestOptions *options, IngestResult *results);
+BlockRing* blockRingCreate(RingKind kind, size_t capacity, WaitPolicy policy);
+bool blockRingTryPush(BlockRing *ring, const Block *block);
+bool blockRingTryPop(BlockRing *ring, Block *block);
+bool blockRingPush(BlockRing *ring, const Block *block);
+bool blockRingPop(BlockRing *ring, Block *block);
+void blockRingClose(BlockRing *ring);
+void freeBlockRing(BlockRing *ring);
+Pipeline* pipelineCreate(size_t ring_capacity, WaitPolicy policy);
+int pipelineAddStage(Pipeline *pipeline, StageFunction function, void *context, int threads);
+int pipelineStart(Pipeline *pipeline);
+bool pipelinePush(Pipeline *pipeline, const Block *block);
+void pipelineFinish(Pipeline *pipeline);
+bool pipelinePop(Pipeline *pipeline, Block *block);
+void pipelineStageStats(Pipeline *pipeline, int stage, uint64_t *items, uint64_t *bytes, uint64_t *busy_ns);
+void freePipeline(Pipeline *pipeline);
+int scanCompressedFiles(CompiledDFA *dfa, const char **paths, int count, int threads, IngestResult *results);
+int scanDirectory(CompiledDFA *dfa, const char *root, const ScanOptions *options, ScanReport *report);
+void freeScanReport(ScanReport *report);
+#ifdef __linux__
+MatchServer* matchServerStart(const char *socket_path, CompiledDFA **automata, int count, int workers);
+void matchServerStats(MatchServer *server, uint64_t *served, uint64_t *batches);
+void matchServerStop(MatchServer *server);
+MatchClient* matchClientConnect(const char *socket_path);
+int matchClientQuery(MatchClient *client, int automaton, const char **inputs, int count, ReplyStatus *replies);
+void matchClientClose(MatchClient *client);
+StreamScheduler* streamSchedulerCreate(CompiledDFA *dfa, int workers, StreamMatchCallback on_match,
+                                       StreamCloseCallback on_close, void *context);
+int streamSchedulerAttach(StreamScheduler *scheduler, int fd, uint64_t stream);
+long streamSchedulerActive(StreamScheduler *scheduler);
+void streamSchedulerStop(StreamScheduler *scheduler);
+#endif
+void latencyEnable(bool enabled);
+void latencyRecord(Engine engine, size_t input_length, uint64_t ns);
+void latencyMerge(LatencyHistogram out[NUM_ENGINES][LATENCY_LENGTH_CLASSES]);
+uint64_t latencyPercentile(LatencyHistogram *hist, double percentile);
+void latencyExport(FILE *out);
 
 // Initialize FSA
 void initFSA(FSA *fsa) {
@@ -82,10 +928,20 @@ void addTransition(FSA *fsa, int from, int to, char symbol) {
         fsa->transitions[fsa->num_transitions].from_state = from;
         fsa->transitions[fsa->num_transitions].to_state = to;
         fsa->transitions[fsa->num_transitions].symbol = symbol;
+        fsa->transitions[fsa->num_transitions].tag = NO_TAG;
         fsa->num_transitions++;
     }
 }
 
+// Add an epsilon transition that records the current position in a
+// capture slot
+void addCaptureTransition(FSA *fsa, int from, int to, int slot) {
+    if (fsa->num_transitions < MAX_TRANSITIONS && slot >= 0 && slot < MAX_CAPTURE_SLOTS) {
+        addTransition(fsa, from, to, EPSILON);
+        fsa->transitions[fsa->num_transitions - 1].tag = slot;
+    }
+}
+
 // Check if state is in set
 bool stateSetContains(StateSet *set, int state) {
     for (int i = 0; i < set->size; i++) {
@@ -181,8 +1037,8 @@ StateSet nextSet(FSA *fsa, StateSet *states, char symbol) {
     return result;
 }
 
-// Check if the FSA accepts a given string
-bool accepts(FSA *fsa, const char *input) {
+// Subset simulation behind accepts
+static bool simulateNFA(FSA *fsa, const char *input) {
     // Find start state
     int start_state = -1;
     for (int i = 0; i < fsa->num_states; i++) {
@@ -217,6 +1073,27 @@ bool accepts(FSA *fsa, const char *input) {
     return false;
 }
 
+// Monotonic clock in nanoseconds
+static uint64_t monotonicNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static atomic_bool latency_enabled;
+
+// Check if the FSA accepts a given string
+bool accepts(FSA *fsa, const char *input) {
+    if (!atomic_load_explicit(&latency_enabled, memory_order_relaxed)) {
+        return simulateNFA(fsa, input);
+    }
+
+    uint64_t start = monotonicNanos();
+    bool result = simulateNFA(fsa, input);
+    latencyRecord(ENGINE_NFA, strlen(input), monotonicNanos() - start);
+    return result;
+}
+
 // Check if FSA is deterministic
 bool deterministic(FSA *fsa) {
     // Check for epsilon transitions
@@ -258,7 +1135,8 @@ void copyStateSet(StateSet *dest, StateSet *src) {
     }
 }
 
-// Convert NFA to DFA using subset construction
+// Convert NFA to DFA using subset construction. Returns NULL if the DFA
+// would exceed MAX_STATES or MAX_TRANSITIONS.
 FSA* toDFA(FSA *fsa) {
     FSA *dfa = (FSA *)malloc(sizeof(FSA));
     initFSA(dfa);
@@ -318,7 +1196,11 @@ FSA* toDFA(FSA *fsa) {
                 }
 
                 if (existing_state == -1) {
-                    // New state
+                    // New state; give up rather than overflow the tables
+                    if (num_dfa_states == MAX_STATES) {
+                        free(dfa);
+                        return NULL;
+                    }
                     copyStateSet(&dfa_states[num_dfa_states], &next_states);
                     copyStateSet(&unmarked[num_unmarked++], &next_states);
                     existing_state = num_dfa_states++;
@@ -333,6 +1215,10 @@ FSA* toDFA(FSA *fsa) {
                     }
                 }
 
+                if (dfa->num_transitions == MAX_TRANSITIONS) {
+                    free(dfa);
+                    return NULL;
+                }
                 addTransition(dfa, from_index, existing_state, alphabet[a]);
             }
         }
@@ -353,83 +1239,6744 @@ FSA* toDFA(FSA *fsa) {
     return dfa;
 }
 
-// Print state set
-void printStateSet(StateSet *set) {
-    printf("{");
-    for (int i = 0; i < set->size; i++) {
-        printf("%d", set->states[i]);
-        if (i < set->size - 1) printf(",");
+// 64-bit FNV-1a, used for automaton version hashes
+#define FNV_OFFSET 14695981039346656037ull
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
     }
-    printf("}");
+    return hash;
 }
 
-// Main function with example usage
-int main() {
-    FSA fsa;
-    initFSA(&fsa);
+// Version hash of an FSA's states, flags and transitions
+uint64_t fsaVersion(FSA *fsa) {
+    uint64_t hash = FNV_OFFSET;
+    for (int i = 0; i < fsa->num_states; i++) {
+        int state = fsa->states[i];
+        unsigned char flags = (unsigned char)(fsa->is_start[state] |
+                                              fsa->is_accepting[state] << 1);
+        hash = fnv1a(hash, &state, sizeof(int));
+        hash = fnv1a(hash, &flags, 1);
+    }
+    for (int i = 0; i < fsa->num_transitions; i++) {
+        Transition *t = &fsa->transitions[i];
+        hash = fnv1a(hash, &t->from_state, sizeof(int));
+        hash = fnv1a(hash, &t->to_state, sizeof(int));
+        hash = fnv1a(hash, &t->symbol, 1);
+        hash = fnv1a(hash, &t->tag, sizeof(int));
+    }
+    return hash;
+}
 
-    // Build the example FSA from the assignment
-    addState(&fsa, 0, true, false);
-    addState(&fsa, 1, false, false);
-    addState(&fsa, 2, false, false);
-    addState(&fsa, 3, false, false);
-    addState(&fsa, 4, false, false);
-    addState(&fsa, 5, false, false);
-    addState(&fsa, 6, false, false);
-    addState(&fsa, 7, false, false);
-    addState(&fsa, 8, false, false);
-    addState(&fsa, 9, false, false);
-    addState(&fsa, 10, false, true);
+// Compile a deterministic FSA (e.g. the result of toDFA) into a
+// premultiplied transition table. Returns NULL if the FSA is not
+// deterministic.
+CompiledDFA* compileDFA(FSA *dfa) {
+    if (!deterministic(dfa)) {
+        return NULL;
+    }
 
-    // Add transitions (epsilon is '\0')
-    addTransition(&fsa, 0, 1, EPSILON);
-    addTransition(&fsa, 0, 7, EPSILON);
-    addTransition(&fsa, 1, 2, EPSILON);
-    addTransition(&fsa, 1, 4, EPSILON);
-    addTransition(&fsa, 2, 3, 'a');
-    addTransition(&fsa, 3, 6, EPSILON);
-    addTransition(&fsa, 4, 5, 'b');
-    addTransition(&fsa, 5, 6, EPSILON);
-    addTransition(&fsa, 6, 1, EPSILON);
-    addTransition(&fsa, 6, 7, EPSILON);
-    addTransition(&fsa, 7, 8, 'a');
-    addTransition(&fsa, 8, 9, 'b');
-    addTransition(&fsa, 9, 10, 'b');
+    CompiledDFA *compiled = (CompiledDFA *)malloc(sizeof(CompiledDFA));
+    if (compiled == NULL) {
+        return NULL;
+    }
+    compiled->num_states = dfa->num_states + 1;
+    compiled->table = (int *)malloc(sizeof(int) * 256 * compiled->num_states);
+    if (compiled->table == NULL) {
+        freeCompiledDFA(compiled);
+        return NULL;
+    }
 
-    // Test operations
-    printf("Testing FSA Operations:\n\n");
+    // Assign rows: non-accepting states, the dead state, accepting states
+    int row[MAX_STATES];
+    for (int i = 0; i < MAX_STATES; i++) {
+        row[i] = DFA_DEAD;
+    }
+    int next_row = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            compiled->dead = 256 * next_row++;
+            compiled->accept_min = 256 * next_row;
+        }
+        for (int i = 0; i < dfa->num_states; i++) {
+            int state = dfa->states[i];
+            if (dfa->is_accepting[state] == (pass == 1)) {
+                row[state] = next_row++;
+            }
+        }
+    }
 
-    // Test closure
-    printf("Closure of state 3: ");
-    StateSet c = closure(&fsa, 3);
-    printStateSet(&c);
-    printf("\n\n");
+    compiled->start = compiled->dead;
+    for (int i = 0; i < dfa->num_states; i++) {
+        if (dfa->is_start[dfa->states[i]]) {
+            compiled->start = 256 * row[dfa->states[i]];
+            break;
+        }
+    }
 
-    // Test next
-    printf("Next from state 4 with 'b': ");
-    StateSet n = next(&fsa, 4, 'b');
-    printStateSet(&n);
-    printf("\n\n");
+    for (int i = 0; i < 256 * compiled->num_states; i++) {
+        compiled->table[i] = compiled->dead;
+    }
+    for (int i = 0; i < dfa->num_transitions; i++) {
+        Transition *t = &dfa->transitions[i];
+        if (row[t->from_state] == DFA_DEAD || row[t->to_state] == DFA_DEAD) continue;
+        compiled->table[256 * row[t->from_state] + (unsigned char)t->symbol] =
+            256 * row[t->to_state];
+    }
 
-    // Test deterministic
-    printf("Is deterministic: %s\n\n", deterministic(&fsa) ? "true" : "false");
+    compiled->version = fnv1a(FNV_OFFSET, &compiled->start, sizeof(int));
+    compiled->version = fnv1a(compiled->version, &compiled->dead, sizeof(int));
+    compiled->version = fnv1a(compiled->version, compiled->table,
+                              sizeof(int) * 256 * compiled->num_states);
+    return compiled;
+}
 
-    // Test accepts
-    printf("Accepts 'abb': %s\n", accepts(&fsa, "abb") ? "true" : "false");
-    printf("Accepts 'aabb': %s\n", accepts(&fsa, "aabb") ? "true" : "false");
-    printf("Accepts 'babb': %s\n", accepts(&fsa, "babb") ? "true" : "false");
-    printf("Accepts 'ab': %s\n\n", accepts(&fsa, "ab") ? "true" : "false");
+void freeCompiledDFA(CompiledDFA *dfa) {
+    if (dfa == NULL) return;
+    free(dfa->table);
+    free(dfa);
+}
 
-    // Convert to DFA
-    printf("Converting to DFA...\n");
-    FSA *dfa = toDFA(&fsa);
-    printf("DFA has %d states\n", dfa->num_states);
-    printf("DFA is deterministic: %s\n\n", deterministic(dfa) ? "true" : "false");
+// Check if a compiled state id is accepting
+static inline bool compiledAccepting(CompiledDFA *dfa, int state) {
+    return state >= dfa->accept_min;
+}
 
-    // Test DFA accepts same strings
-    printf("DFA accepts 'abb': %s\n", accepts(dfa, "abb") ? "true" : "false");
-    printf("DFA accepts 'aabb': %s\n", accepts(dfa, "aabb") ? "true" : "false");
+// Table walk behind acceptsCompiled: one load and one compare per byte.
+// Only the dead state leaves the loop early; acceptance is read off the
+// final id.
+static bool runCompiled(CompiledDFA *dfa, const char *input) {
+    const int *table = dfa->table;
+    const int special = dfa->dead;
+    int state = dfa->start;
+
+    for (int i = 0; input[i] != '\0'; i++) {
+        state = table[state + (unsigned char)input[i]];
+        if (state == special) {
+            return false;
+        }
+    }
+    return compiledAccepting(dfa, state);
+}
+
+// Check if a compiled DFA accepts a given string in O(n)
+bool acceptsCompiled(CompiledDFA *dfa, const char *input) {
+    if (!atomic_load_explicit(&latency_enabled, memory_order_relaxed)) {
+        return runCompiled(dfa, input);
+    }
+
+    uint64_t start = monotonicNanos();
+    bool result = runCompiled(dfa, input);
+    latencyRecord(ENGINE_DFA, strlen(input), monotonicNanos() - start);
+    return result;
+}
+
+// Batch input paired with its position in the caller's array
+typedef struct {
+    const char *input;
+    int index;
+} BatchEntry;
+
+static int compareBatchEntries(const void *a, const void *b) {
+    return strcmp(((const BatchEntry *)a)->input, ((const BatchEntry *)b)->input);
+}
+
+// Match a batch of inputs, walking each shared prefix only once. Inputs
+// are sorted so that neighbours share their longest common prefixes; the
+// DFA state after every byte of the previous input is kept on a stack, and
+// each input resumes from the state at its common prefix with the
+// previous one. Results are written in the original order.
+void acceptsBatchShared(CompiledDFA *dfa, const char **inputs, int count, bool *results) {
+    BatchEntry *entries = (BatchEntry *)malloc(sizeof(BatchEntry) * (count ? count : 1));
+    if (entries == NULL) {
+        for (int i = 0; i < count; i++) {
+            results[i] = runCompiled(dfa, inputs[i]);
+        }
+        return;
+    }
+
+    size_t max_length = 0;
+    for (int i = 0; i < count; i++) {
+        size_t length = strlen(inputs[i]);
+        if (length > max_length) max_length = length;
+        entries[i].input = inputs[i];
+        entries[i].index = i;
+    }
+    qsort(entries, count, sizeof(BatchEntry), compareBatchEntries);
+
+    // stack[d] is the state after the first d bytes of the previous input,
+    // valid for d <= walked
+    int *stack = (int *)malloc(sizeof(int) * (max_length + 1));
+    if (stack == NULL) {
+        free(entries);
+        for (int i = 0; i < count; i++) {
+            results[i] = runCompiled(dfa, inputs[i]);
+        }
+        return;
+    }
+    const char *previous = "";
+    size_t walked = 0;
+    stack[0] = dfa->start;
+
+    for (int i = 0; i < count; i++) {
+        const char *input = entries[i].input;
+        size_t depth = 0;
+        while (depth < walked && input[depth] == previous[depth]) {
+            depth++;
+        }
+
+        int state = stack[depth];
+        while (input[depth] != '\0' && state != dfa->dead) {
+            state = dfa->table[state + (unsigned char)input[depth]];
+            stack[++depth] = state;
+        }
+
+        results[entries[i].index] = compiledAccepting(dfa, state);
+        previous = input;
+        walked = depth;
+    }
+
+    free(entries);
+    free(stack);
+}
+
+// Epsilon-close a state set in place, charging one unit of work per
+// transition scanned. Returns false once the budget is spent.
+static bool budgetedClosure(FSA *fsa, StateSet *set, long *work, long budget) {
+    StateSet stack;
+    copyStateSet(&stack, set);
+
+    while (stack.size > 0) {
+        int current = stack.states[--stack.size];
+
+        *work += fsa->num_transitions;
+        if (*work > budget) {
+            return false;
+        }
+        for (int i = 0; i < fsa->num_transitions; i++) {
+            if (fsa->transitions[i].from_state == current &&
+                fsa->transitions[i].symbol == EPSILON &&
+                !stateSetContains(set, fsa->transitions[i].to_state)) {
+                addToStateSet(set, fsa->transitions[i].to_state);
+                addToStateSet(&stack, fsa->transitions[i].to_state);
+            }
+        }
+    }
+    return true;
+}
+
+// NFA simulation behind acceptsBudgeted
+static MatchStatus simulateNFABudgeted(FSA *fsa, const char *input, long budget) {
+    long work = 0;
+    StateSet current = {.size = 0};
+
+    for (int i = 0; i < fsa->num_states; i++) {
+        if (fsa->is_start[fsa->states[i]]) {
+            addToStateSet(&current, fsa->states[i]);
+            break;
+        }
+    }
+    if (current.size == 0) {
+        return MATCH_REJECT;
+    }
+    if (!budgetedClosure(fsa, &current, &work, budget)) {
+        return MATCH_BUDGET_EXCEEDED;
+    }
+
+    for (int i = 0; input[i] != '\0'; i++) {
+        // current is already closed, so one move plus one closure suffices
+        StateSet moved = {.size = 0};
+        for (int j = 0; j < current.size; j++) {
+            work += fsa->num_transitions;
+            if (work > budget) {
+                return MATCH_BUDGET_EXCEEDED;
+            }
+            for (int k = 0; k < fsa->num_transitions; k++) {
+                if (fsa->transitions[k].from_state == current.states[j] &&
+                    fsa->transitions[k].symbol == input[i]) {
+                    addToStateSet(&moved, fsa->transitions[k].to_state);
+                }
+            }
+        }
+        if (moved.size == 0) {
+            return MATCH_REJECT;
+        }
+        if (!budgetedClosure(fsa, &moved, &work, budget)) {
+            return MATCH_BUDGET_EXCEEDED;
+        }
+        current = moved;
+    }
+
+    for (int i = 0; i < current.size; i++) {
+        if (fsa->is_accepting[current.states[i]]) {
+            return MATCH_ACCEPT;
+        }
+    }
+    return MATCH_REJECT;
+}
+
+// Match under an explicit work budget. With a compiled DFA the cost is one
+// unit per input byte, so the run is O(n) regardless of the automaton.
+// Without one, the NFA is simulated and every transition scanned costs one
+// unit. Either way the call gives up with MATCH_BUDGET_EXCEEDED as soon as
+// the budget is spent, so untrusted automata cannot pin a thread.
+MatchStatus acceptsBudgeted(FSA *fsa, CompiledDFA *compiled, const char *input, long budget) {
+    bool timed = atomic_load_explicit(&latency_enabled, memory_order_relaxed);
+    uint64_t start = timed ? monotonicNanos() : 0;
+    MatchStatus status;
+
+    if (compiled != NULL) {
+        size_t length = strlen(input);
+        if ((long)length > budget) {
+            status = MATCH_BUDGET_EXCEEDED;
+        } else {
+            status = runCompiled(compiled, input) ? MATCH_ACCEPT : MATCH_REJECT;
+        }
+    } else {
+        status = simulateNFABudgeted(fsa, input, budget);
+    }
+
+    if (timed) {
+        latencyRecord(compiled != NULL ? ENGINE_DFA : ENGINE_NFA, strlen(input),
+                      monotonicNanos() - start);
+    }
+    return status;
+}
+
+// Start a stream at the automaton's start state. Pass a compiled DFA to
+// run the table, or NULL to simulate the FSA directly.
+void streamInit(StreamMatcher *m, FSA *fsa, CompiledDFA *compiled) {
+    m->fsa = fsa;
+    m->compiled = compiled;
+    m->offset = 0;
+    m->active.size = 0;
+    m->dfa_state = 0;
+
+    if (compiled != NULL) {
+        m->version = compiled->version;
+        m->dfa_state = compiled->start;
+        return;
+    }
+
+    m->version = fsaVersion(fsa);
+    for (int i = 0; i < fsa->num_states; i++) {
+        if (fsa->is_start[fsa->states[i]]) {
+            m->active = closure(fsa, fsa->states[i]);
+            break;
+        }
+    }
+}
+
+// Advance the stream over the next chunk of input
+void streamFeed(StreamMatcher *m, const char *data, size_t length) {
+    m->offset += length;
+
+    if (m->compiled != NULL) {
+        const int *table = m->compiled->table;
+        const int dead = m->compiled->dead;
+        int state = m->dfa_state;
+        for (size_t i = 0; i < length; i++) {
+            state = table[state + (unsigned char)data[i]];
+            if (state == dead) {
+                break;
+            }
+        }
+        m->dfa_state = state;
+        return;
+    }
+
+    for (size_t i = 0; m->active.size > 0 && i < length; i++) {
+        // A NUL byte would otherwise follow epsilon edges
+        if (data[i] == EPSILON) {
+            m->active.size = 0;
+            break;
+        }
+        m->active = nextSet(m->fsa, &m->active, data[i]);
+    }
+}
+
+// Check if the input consumed so far is accepted
+bool streamAccepting(StreamMatcher *m) {
+    if (m->compiled != NULL) {
+        return compiledAccepting(m->compiled, m->dfa_state);
+    }
+
+    for (int i = 0; i < m->active.size; i++) {
+        if (m->fsa->is_accepting[m->active.states[i]]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void putU64(unsigned char *buf, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        buf[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint64_t getU64(const unsigned char *buf) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)buf[i] << (8 * i);
+    }
+    return value;
+}
+
+// Serialize the stream position into a compact little-endian blob:
+// magic, mode (0 NFA, 1 DFA), automaton version, byte offset, then the DFA
+// state's row (4 bytes) or the NFA active set as a bitmap.
+// Returns the blob size, or 0 if the buffer is too small.
+size_t streamCheckpoint(StreamMatcher *m, unsigned char *buf, size_t capacity) {
+    size_t size = 4 + 1 + 8 + 8 + (m->compiled != NULL ? 4 : CHECKPOINT_BITMAP_BYTES);
+    if (capacity < size) {
+        return 0;
+    }
+
+    memcpy(buf, CHECKPOINT_MAGIC, 4);
+    buf[4] = m->compiled != NULL;
+    putU64(buf + 5, m->version);
+    putU64(buf + 13, m->offset);
+
+    unsigned char *body = buf + 21;
+    if (m->compiled != NULL) {
+        uint32_t state = (uint32_t)(m->dfa_state / 256);
+        for (int i = 0; i < 4; i++) {
+            body[i] = (unsigned char)(state >> (8 * i));
+        }
+    } else {
+        memset(body, 0, CHECKPOINT_BITMAP_BYTES);
+        for (int i = 0; i < m->active.size; i++) {
+            body[m->active.states[i] / 8] |= (unsigned char)(1 << (m->active.states[i] % 8));
+        }
+    }
+    return size;
+}
+
+// Restore a checkpoint into a matcher initialized with streamInit on the
+// same automaton. Fails if the blob is malformed, was taken in the other
+// mode, or the automaton version does not match.
+bool streamRestore(StreamMatcher *m, const unsigned char *buf, size_t length) {
+    if (length < 21 || memcmp(buf, CHECKPOINT_MAGIC, 4) != 0 ||
+        buf[4] != (m->compiled != NULL) || getU64(buf + 5) != m->version) {
+        return false;
+    }
+
+    const unsigned char *body = buf + 21;
+    if (m->compiled != NULL) {
+        if (length != 21 + 4) {
+            return false;
+        }
+        uint32_t state = 0;
+        for (int i = 0; i < 4; i++) {
+            state |= (uint32_t)body[i] << (8 * i);
+        }
+        if (state >= (uint32_t)m->compiled->num_states) {
+            return false;
+        }
+        m->dfa_state = (int)state * 256;
+    } else {
+        if (length != 21 + CHECKPOINT_BITMAP_BYTES) {
+            return false;
+        }
+        StateSet active = {.size = 0};
+        for (int state = 0; state < MAX_STATES; state++) {
+            if (body[state / 8] & (1 << (state % 8))) {
+                addToStateSet(&active, state);
+            }
+        }
+        m->active = active;
+    }
+
+    m->offset = getU64(buf + 13);
+    return true;
+}
+
+// Build a scan group over count compiled DFAs. The DFAs are copied, so
+// they may be freed afterwards.
+ScanGroup* scanGroupCreate(CompiledDFA **dfas, int count) {
+    ScanGroup *group = (ScanGroup *)calloc(1, sizeof(ScanGroup));
+    if (group == NULL) {
+        return NULL;
+    }
+
+    int rows = 0;
+    for (int k = 0; k < count; k++) {
+        rows += dfas[k]->num_states;
+    }
+
+    // An empty group still gets valid (non-NULL) arrays
+    int slots = count > 0 ? count : 1;
+    group->count = count;
+    group->table = (int *)malloc(sizeof(int) * 256 * (rows > 0 ? rows : 1));
+    group->starts = (int *)malloc(sizeof(int) * slots);
+    group->states = (int *)malloc(sizeof(int) * slots);
+    group->accept_min = (int *)malloc(sizeof(int) * slots);
+    group->accept_max = (int *)malloc(sizeof(int) * slots);
+    if (group->table == NULL || group->starts == NULL || group->states == NULL ||
+        group->accept_min == NULL || group->accept_max == NULL) {
+        freeScanGroup(group);
+        return NULL;
+    }
+
+    int base = 0;
+    for (int k = 0; k < count; k++) {
+        CompiledDFA *dfa = dfas[k];
+        int size = 256 * dfa->num_states;
+        for (int i = 0; i < size; i++) {
+            group->table[base + i] = base + dfa->table[i];
+        }
+        group->starts[k] = base + dfa->start;
+        group->accept_min[k] = base + dfa->accept_min;
+        group->accept_max[k] = base + size;
+        base += size;
+    }
+
+    scanGroupReset(group);
+    return group;
+}
+
+// Put every automaton back at its start state
+void scanGroupReset(ScanGroup *group) {
+    memcpy(group->states, group->starts, sizeof(int) * group->count);
+}
+
+// Advance all automata over the next chunk, reading each byte once
+void scanGroupFeed(ScanGroup *group, const char *data, size_t length) {
+    int *table = group->table;
+    int *states = group->states;
+    int count = group->count;
+
+    for (size_t i = 0; i < length; i++) {
+        int byte = (unsigned char)data[i];
+        int k = 0;
+#ifdef __AVX2__
+        __m256i offset = _mm256_set1_epi32(byte);
+        for (; k + 8 <= count; k += 8) {
+            __m256i current = _mm256_loadu_si256((__m256i *)&states[k]);
+            __m256i next = _mm256_i32gather_epi32(table, _mm256_add_epi32(current, offset), 4);
+            _mm256_storeu_si256((__m256i *)&states[k], next);
+        }
+#endif
+        for (; k < count; k++) {
+            states[k] = table[states[k] + byte];
+        }
+    }
+}
+
+// Check if automaton index accepts the input fed since the last reset
+bool scanGroupAccepting(ScanGroup *group, int index) {
+    return group->states[index] >= group->accept_min[index] &&
+           group->states[index] < group->accept_max[index];
+}
+
+void freeScanGroup(ScanGroup *group) {
+    if (group == NULL) return;
+    free(group->table);
+    free(group->starts);
+    free(group->states);
+    free(group->accept_min);
+    free(group->accept_max);
+    free(group);
+}
+
+// Mark every state reachable from state (including itself)
+static void markReachable(FSA *fsa, int state, bool reached[MAX_STATES]) {
+    StateSet stack = {.size = 0};
+    reached[state] = true;
+    addToStateSet(&stack, state);
+
+    while (stack.size > 0) {
+        int current = stack.states[--stack.size];
+        for (int i = 0; i < fsa->num_transitions; i++) {
+            int to = fsa->transitions[i].to_state;
+            if (fsa->transitions[i].from_state == current && !reached[to]) {
+                reached[to] = true;
+                addToStateSet(&stack, to);
+            }
+        }
+    }
+}
+
+// A start-state branch considered for sharding
+typedef struct {
+    int transition;
+    int first_symbol;
+    int size;
+} ShardBranch;
+
+static int compareBranches(const void *a, const void *b) {
+    const ShardBranch *x = (const ShardBranch *)a;
+    const ShardBranch *y = (const ShardBranch *)b;
+    if (x->first_symbol != y->first_symbol) return x->first_symbol - y->first_symbol;
+    return x->transition - y->transition;
+}
+
+// Build the sub-automaton made of the start state, branches [first, last)
+// and everything reachable from them. The start state's transitions are
+// exactly the branches, even when a branch loops back to it.
+static FSA* buildShard(FSA *fsa, int start_state, ShardBranch *branches, int first, int last) {
+    FSA *shard = (FSA *)malloc(sizeof(FSA));
+    if (shard == NULL) {
+        return NULL;
+    }
+    initFSA(shard);
+    addState(shard, start_state, true, fsa->is_accepting[start_state]);
+
+    bool reached[MAX_STATES] = {false};
+    for (int b = first; b < last; b++) {
+        Transition *t = &fsa->transitions[branches[b].transition];
+        addTransition(shard, t->from_state, t->to_state, t->symbol);
+        markReachable(fsa, t->to_state, reached);
+    }
+
+    for (int i = 0; i < fsa->num_states; i++) {
+        int state = fsa->states[i];
+        if (reached[state] && state != start_state) {
+            addState(shard, state, false, fsa->is_accepting[state]);
+        }
+    }
+    for (int i = 0; i < fsa->num_transitions; i++) {
+        Transition *t = &fsa->transitions[i];
+        if (reached[t->from_state] && t->from_state != start_state) {
+            addTransition(shard, t->from_state, t->to_state, t->symbol);
+        }
+    }
+    return shard;
+}
+
+// Split a multi-pattern automaton into at most num_shards sub-automata and
+// determinize each one. The branches leaving the start state are the
+// patterns: they are ordered by leading symbol so shared prefixes land in
+// the same or adjacent shards, then cut into runs of similar
+// reachable-state counts.
+// Automata whose branches loop back to the start state cannot be split and
+// form a single shard. Returns NULL if a shard is still too large for
+// toDFA.
+ShardSet* shardAutomaton(FSA *fsa, int num_shards) {
+    int start_state = -1;
+    for (int i = 0; i < fsa->num_states; i++) {
+        if (fsa->is_start[fsa->states[i]]) {
+            start_state = fsa->states[i];
+            break;
+        }
+    }
+    if (start_state == -1) {
+        return NULL;
+    }
+    if (num_shards < 1) num_shards = 1;
+    if (num_shards > MAX_SHARDS) num_shards = MAX_SHARDS;
+
+    ShardBranch branches[MAX_TRANSITIONS];
+    int num_branches = 0;
+    int total_size = 0;
+    bool splittable = true;
+    for (int i = 0; i < fsa->num_transitions; i++) {
+        Transition *t = &fsa->transitions[i];
+        if (t->from_state != start_state) {
+            continue;
+        }
+
+        bool reached[MAX_STATES] = {false};
+        markReachable(fsa, t->to_state, reached);
+        if (reached[start_state]) {
+            splittable = false;
+        }
+
+        ShardBranch *branch = &branches[num_branches++];
+        branch->transition = i;
+        branch->size = 0;
+        for (int s = 0; s < MAX_STATES; s++) {
+            branch->size += reached[s];
+        }
+        total_size += branch->size;
+
+        // Leading symbol: the branch's own symbol, or the smallest symbol
+        // leaving the epsilon closure of its target
+        branch->first_symbol = 256;
+        if (t->symbol != EPSILON) {
+            branch->first_symbol = (unsigned char)t->symbol;
+        } else {
+            StateSet target_closure = closure(fsa, t->to_state);
+            for (int j = 0; j < fsa->num_transitions; j++) {
+                Transition *u = &fsa->transitions[j];
+                if (u->symbol != EPSILON && stateSetContains(&target_closure, u->from_state) &&
+                    (unsigned char)u->symbol < branch->first_symbol) {
+                    branch->first_symbol = (unsigned char)u->symbol;
+                }
+            }
+        }
+    }
+    if (!splittable || num_branches < 2) {
+        num_shards = 1;
+    }
+    qsort(branches, num_branches, sizeof(ShardBranch), compareBranches);
+
+    ShardSet *set = (ShardSet *)calloc(1, sizeof(ShardSet));
+    if (set == NULL) {
+        return NULL;
+    }
+
+    int target_size = (total_size + num_shards - 1) / num_shards;
+    int first = 0;
+    while (first < num_branches || (first == 0 && num_branches == 0)) {
+        int last = first;
+        int size = 0;
+        bool last_shard = set->num_shards == num_shards - 1;
+        while (last < num_branches) {
+            if (!last_shard && last > first && size >= target_size) {
+                break;
+            }
+            size += branches[last++].size;
+        }
+
+        FSA *shard = buildShard(fsa, start_state, branches, first, last);
+        FSA *shard_dfa = shard != NULL ? toDFA(shard) : NULL;
+        CompiledDFA *compiled = shard_dfa != NULL ? compileDFA(shard_dfa) : NULL;
+        free(shard);
+        free(shard_dfa);
+        if (compiled == NULL) {
+            freeShardSet(set);
+            return NULL;
+        }
+        set->shards[set->num_shards++] = compiled;
+
+        if (last == first) break;
+        first = last;
+    }
+
+    return set;
+}
+
+// Per-thread state for shardScan
+typedef struct {
+    CompiledDFA *dfa;
+    const char *data;
+    size_t length;
+    int shard;
+    MatchEvent *events;
+    size_t count;
+    size_t capacity;
+} ShardJob;
+
+static bool appendEvent(ShardJob *job, uint64_t offset) {
+    if (job->count == job->capacity) {
+        size_t capacity = job->capacity ? job->capacity * 2 : 64;
+        MatchEvent *events = (MatchEvent *)realloc(job->events, sizeof(MatchEvent) * capacity);
+        if (events == NULL) {
+            return false;
+        }
+        job->events = events;
+        job->capacity = capacity;
+    }
+    job->events[job->count].offset = offset;
+    job->events[job->count].shard = job->shard;
+    job->count++;
+    return true;
+}
+
+static void* runShard(void *arg) {
+    ShardJob *job = (ShardJob *)arg;
+    const int *table = job->dfa->table;
+    const int special = job->dfa->dead;
+    int state = job->dfa->start;
+
+    if (state > special && !appendEvent(job, 0)) {
+        return NULL;
+    }
+    for (size_t i = 0; i < job->length; i++) {
+        state = table[state + (unsigned char)job->data[i]];
+        if (state >= special) {
+            // Slow path: either dead or a match
+            if (state == special || !appendEvent(job, i + 1)) {
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Run every shard over the same input on its own thread and merge their
+// match events by offset (ties by shard index). Every shard contains the
+// start state, so a match of the empty prefix is reported once, by the
+// first shard that has it. *events receives a malloc'd array the caller
+// frees; returns the number of events.
+size_t shardScan(ShardSet *set, const char *data, size_t length, MatchEvent **events) {
+    ShardJob jobs[MAX_SHARDS];
+    pthread_t threads[MAX_SHARDS];
+    bool started[MAX_SHARDS];
+
+    for (int k = 0; k < set->num_shards; k++) {
+        jobs[k] = (ShardJob){set->shards[k], data, length, k, NULL, 0, 0};
+        started[k] = pthread_create(&threads[k], NULL, runShard, &jobs[k]) == 0;
+        if (!started[k]) {
+            runShard(&jobs[k]);
+        }
+    }
+
+    size_t total = 0;
+    for (int k = 0; k < set->num_shards; k++) {
+        if (started[k]) {
+            pthread_join(threads[k], NULL);
+        }
+        total += jobs[k].count;
+    }
+
+    *events = (MatchEvent *)malloc(sizeof(MatchEvent) * (total ? total : 1));
+    size_t heads[MAX_SHARDS] = {0};
+    size_t merged = 0;
+    for (size_t taken = 0; *events != NULL && taken < total; taken++) {
+        int best = -1;
+        for (int k = 0; k < set->num_shards; k++) {
+            if (heads[k] < jobs[k].count &&
+                (best == -1 || jobs[k].events[heads[k]].offset <
+                               jobs[best].events[heads[best]].offset)) {
+                best = k;
+            }
+        }
+        MatchEvent *event = &jobs[best].events[heads[best]++];
+        if (event->offset != 0 || merged == 0) {
+            (*events)[merged++] = *event;
+        }
+    }
+
+    for (int k = 0; k < set->num_shards; k++) {
+        free(jobs[k].events);
+    }
+    return *events != NULL ? merged : 0;
+}
+
+void freeShardSet(ShardSet *set) {
+    if (set == NULL) return;
+    for (int k = 0; k < set->num_shards; k++) {
+        freeCompiledDFA(set->shards[k]);
+    }
+    free(set);
+}
+
+static inline bool bitsTest(const StateBits *set, int state) {
+    return (set->w[state >> 6] >> (state & 63)) & 1;
+}
+
+static inline void bitsSet(StateBits *set, int state) {
+    set->w[state >> 6] |= 1ull << (state & 63);
+}
+
+static inline bool bitsEmpty(const StateBits *set) {
+    return (set->w[0] | set->w[1]) == 0;
+}
+
+static inline bool bitsIntersect(const StateBits *a, const StateBits *b) {
+    return ((a->w[0] & b->w[0]) | (a->w[1] & b->w[1])) != 0;
+}
+
+static inline bool bitsEqual(const StateBits *a, const StateBits *b) {
+    return a->w[0] == b->w[0] && a->w[1] == b->w[1];
+}
+
+// Fold epsilon closures into the FSA's symbol edges
+void buildBitNFA(FSA *fsa, BitNFA *nfa) {
+    memset(nfa, 0, sizeof(BitNFA));
+
+    for (int i = 0; i < fsa->num_states; i++) {
+        int state = fsa->states[i];
+        if (fsa->is_accepting[state]) {
+            bitsSet(&nfa->accepting, state);
+        }
+    }
+    for (int i = 0; i < fsa->num_states; i++) {
+        if (fsa->is_start[fsa->states[i]]) {
+            StateSet start_closure = closure(fsa, fsa->states[i]);
+            for (int j = 0; j < start_closure.size; j++) {
+                bitsSet(&nfa->start, start_closure.states[j]);
+            }
+            break;
+        }
+    }
+
+    // Counting sort of the symbol edges by symbol
+    int counts[257] = {0};
+    for (int i = 0; i < fsa->num_transitions; i++) {
+        if (fsa->transitions[i].symbol != EPSILON) {
+            counts[(unsigned char)fsa->transitions[i].symbol + 1]++;
+        }
+    }
+    for (int c = 0; c < 256; c++) {
+        counts[c + 1] += counts[c];
+    }
+    memcpy(nfa->edge_start, counts, sizeof(counts));
+
+    for (int i = 0; i < fsa->num_transitions; i++) {
+        Transition *t = &fsa->transitions[i];
+        if (t->symbol == EPSILON) {
+            continue;
+        }
+        int e = counts[(unsigned char)t->symbol]++;
+        nfa->edge_from[e] = t->from_state;
+        StateSet target_closure = closure(fsa, t->to_state);
+        for (int j = 0; j < target_closure.size; j++) {
+            bitsSet(&nfa->edge_to[e], target_closure.states[j]);
+        }
+    }
+}
+
+// States reached from set on byte c
+static inline StateBits bitStep(BitNFA *nfa, const StateBits *set, unsigned char c) {
+    StateBits next = {{0, 0}};
+    for (int e = nfa->edge_start[c]; e < nfa->edge_start[c + 1]; e++) {
+        if (bitsTest(set, nfa->edge_from[e])) {
+            next.w[0] |= nfa->edge_to[e].w[0];
+            next.w[1] |= nfa->edge_to[e].w[1];
+        }
+    }
+    return next;
+}
+
+// NFA simulation with the active set held in a bitmask
+bool acceptsBitParallel(BitNFA *nfa, const char *input) {
+    StateBits current = nfa->start;
+    for (int i = 0; input[i] != '\0' && !bitsEmpty(&current); i++) {
+        current = bitStep(nfa, &current, (unsigned char)input[i]);
+    }
+    return bitsIntersect(&current, &nfa->accepting);
+}
+
+// Match a batch of inputs 64 at a time. Word lanes[q] holds state q's
+// membership across the 64 inputs of a block; each step ANDs it with the
+// mask of inputs whose next byte matches an edge's symbol and ORs the
+// result into the edge's epsilon-closed targets. No determinization is
+// needed, and the cost per step depends on the NFA, not the batch size.
+void acceptsBitSliced(BitNFA *nfa, const char **inputs, int count, bool *results) {
+    for (int block = 0; block < count; block += 64) {
+        int lanes_used = count - block < 64 ? count - block : 64;
+        uint64_t lanes[MAX_STATES] = {0};
+        uint64_t next[MAX_STATES];
+        uint64_t symbol_mask[256] = {0};
+        uint64_t accepted = 0;
+        uint64_t all = lanes_used == 64 ? ~0ull : (1ull << lanes_used) - 1;
+
+        for (int q = 0; q < MAX_STATES; q++) {
+            if (bitsTest(&nfa->start, q)) {
+                lanes[q] = all;
+            }
+        }
+
+        uint64_t running = all;
+        for (size_t t = 0; running != 0; t++) {
+            // Lanes whose input ends here are decided by the current set
+            uint64_t live = 0;
+            for (int q = 0; q < MAX_STATES; q++) {
+                live |= lanes[q];
+            }
+            uint64_t in_accepting = 0;
+            for (int q = 0; q < MAX_STATES; q++) {
+                if (bitsTest(&nfa->accepting, q)) {
+                    in_accepting |= lanes[q];
+                }
+            }
+
+            unsigned char symbols[64];
+            int num_symbols = 0;
+            uint64_t continuing = 0;
+            for (uint64_t pending = running; pending != 0; pending &= pending - 1) {
+                int lane = __builtin_ctzll(pending);
+                unsigned char c = (unsigned char)inputs[block + lane][t];
+                if (c == '\0') {
+                    accepted |= in_accepting & (1ull << lane);
+                    continue;
+                }
+                continuing |= 1ull << lane;
+                if (symbol_mask[c] == 0) {
+                    symbols[num_symbols++] = c;
+                }
+                symbol_mask[c] |= 1ull << lane;
+            }
+            running = continuing & live;
+
+            memset(next, 0, sizeof(next));
+            for (int k = 0; k < num_symbols; k++) {
+                unsigned char c = symbols[k];
+                for (int e = nfa->edge_start[c]; e < nfa->edge_start[c + 1]; e++) {
+                    uint64_t moving = lanes[nfa->edge_from[e]] & symbol_mask[c];
+                    if (moving == 0) {
+                        continue;
+                    }
+                    for (int w = 0; w < 2; w++) {
+                        for (uint64_t to = nfa->edge_to[e].w[w]; to != 0; to &= to - 1) {
+                            next[w * 64 + __builtin_ctzll(to)] |= moving;
+                        }
+                    }
+                }
+                symbol_mask[c] = 0;
+            }
+            memcpy(lanes, next, sizeof(lanes));
+        }
+
+        for (int lane = 0; lane < lanes_used; lane++) {
+            results[block + lane] = (accepted >> lane) & 1;
+        }
+    }
+}
+
+static void flushLazyDFA(LazyDFA *lazy) {
+    lazy->num_states = 0;
+    lazy->start = LAZY_UNKNOWN;
+    for (int i = 0; i < LAZY_HASH_SLOTS; i++) {
+        lazy->slots[i] = -1;
+    }
+}
+
+void initLazyDFA(LazyDFA *lazy, BitNFA *nfa) {
+    lazy->nfa = nfa;
+    lazy->flushes = 0;
+    lazy->bytes = 0;
+    flushLazyDFA(lazy);
+}
+
+// Find or add the cached state for set. Sets *flushed when the cache had
+// to be emptied to make room, which invalidates all other state ids.
+static int lazyIntern(LazyDFA *lazy, const StateBits *set, bool *flushed) {
+    uint64_t hash = (set->w[0] ^ (set->w[1] * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    int slot = (int)(hash >> 32) & (LAZY_HASH_SLOTS - 1);
+    while (lazy->slots[slot] != -1) {
+        if (bitsEqual(&lazy->sets[lazy->slots[slot]], set)) {
+            return lazy->slots[slot];
+        }
+        slot = (slot + 1) & (LAZY_HASH_SLOTS - 1);
+    }
+
+    if (lazy->num_states == LAZY_CACHE_STATES) {
+        flushLazyDFA(lazy);
+        lazy->flushes++;
+        *flushed = true;
+        return lazyIntern(lazy, set, flushed);
+    }
+
+    int id = lazy->num_states++;
+    lazy->sets[id] = *set;
+    lazy->accepting[id] = bitsIntersect(set, &lazy->nfa->accepting);
+    for (int c = 0; c < 256; c++) {
+        lazy->next[id][c] = LAZY_UNKNOWN;
+    }
+    lazy->slots[slot] = id;
+    return id;
+}
+
+// Match with the lazy DFA, filling in transitions as they are first used
+bool acceptsLazy(LazyDFA *lazy, const char *input) {
+    bool flushed = false;
+    if (lazy->start == LAZY_UNKNOWN) {
+        if (bitsEmpty(&lazy->nfa->start)) {
+            return false;
+        }
+        lazy->start = lazyIntern(lazy, &lazy->nfa->start, &flushed);
+    }
+
+    int state = lazy->start;
+    int i = 0;
+    for (; input[i] != '\0'; i++) {
+        unsigned char c = (unsigned char)input[i];
+        int next = lazy->next[state][c];
+        if (next == LAZY_UNKNOWN) {
+            StateBits set = bitStep(lazy->nfa, &lazy->sets[state], c);
+            if (bitsEmpty(&set)) {
+                next = DFA_DEAD;
+            } else {
+                flushed = false;
+                next = lazyIntern(lazy, &set, &flushed);
+            }
+            if (!flushed) {
+                lazy->next[state][c] = next;
+            }
+        }
+        if (next == DFA_DEAD) {
+            break;
+        }
+        state = next;
+    }
+
+    lazy->bytes += (uint64_t)i;
+    return input[i] == '\0' && lazy->accepting[state];
+}
+
+// Count the DFA's subsets by exploring from the start set, giving up after
+// limit states (estimated_dfa_states is then -1)
+static int estimateDFAStates(BitNFA *nfa, int limit) {
+    StateBits *seen = (StateBits *)malloc(sizeof(StateBits) * limit);
+    if (seen == NULL || bitsEmpty(&nfa->start)) {
+        free(seen);
+        return seen == NULL ? -1 : 0;
+    }
+
+    int count = 0;
+    seen[count++] = nfa->start;
+    for (int done = 0; done < count; done++) {
+        for (int c = 1; c < 256; c++) {
+            if (nfa->edge_start[c] == nfa->edge_start[c + 1]) {
+                continue;
+            }
+            StateBits next = bitStep(nfa, &seen[done], (unsigned char)c);
+            if (bitsEmpty(&next)) {
+                continue;
+            }
+            bool known = false;
+            for (int k = 0; k < count && !known; k++) {
+                known = bitsEqual(&seen[k], &next);
+            }
+            if (!known) {
+                if (count == limit) {
+                    free(seen);
+                    return -1;
+                }
+                seen[count++] = next;
+            }
+        }
+    }
+
+    free(seen);
+    return count;
+}
+
+// Gather the statistics used for engine selection
+void automatonStats(FSA *fsa, BitNFA *nfa, AutomatonStats *stats) {
+    int epsilons = 0;
+    for (int i = 0; i < fsa->num_transitions; i++) {
+        epsilons += fsa->transitions[i].symbol == EPSILON;
+    }
+
+    stats->num_states = fsa->num_states;
+    stats->num_transitions = fsa->num_transitions;
+    stats->epsilon_density = fsa->num_transitions ?
+        (double)epsilons / fsa->num_transitions : 0.0;
+    stats->estimated_dfa_states = estimateDFAStates(nfa, MAX_STATES);
+}
+
+static inline bool byteSetTest(const uint64_t set[4], unsigned char c) {
+    return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+static inline void byteSetAdd(uint64_t set[4], unsigned char c) {
+    set[c >> 6] |= 1ull << (c & 63);
+}
+
+// States from which an accepting state can be reached, ignoring edges on
+// byte skip (pass -1 to use every edge)
+static StateBits coReachable(BitNFA *nfa, int skip) {
+    StateBits live = nfa->accepting;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int c = 0; c < 256; c++) {
+            if (c == skip) continue;
+            for (int e = nfa->edge_start[c]; e < nfa->edge_start[c + 1]; e++) {
+                if (!bitsTest(&live, nfa->edge_from[e]) &&
+                    bitsIntersect(&nfa->edge_to[e], &live)) {
+                    bitsSet(&live, nfa->edge_from[e]);
+                    changed = true;
+                }
+            }
+        }
+    }
+    return live;
+}
+
+// Longest path from state to acceptance within the useful states, or -1
+// when a cycle is found (color: 0 new, 1 on stack, 2 done)
+static long longestAccepted(BitNFA *nfa, const StateBits *useful, int state,
+                            unsigned char color[MAX_STATES], long longest[MAX_STATES]) {
+    if (color[state] == 2) return longest[state];
+    if (color[state] == 1) return -1;
+    color[state] = 1;
+
+    long best = bitsTest(&nfa->accepting, state) ? 0 : -2;
+    for (int e = 0; e < nfa->edge_start[256]; e++) {
+        if (nfa->edge_from[e] != state) continue;
+        for (int q = 0; q < MAX_STATES; q++) {
+            if (!bitsTest(&nfa->edge_to[e], q) || !bitsTest(useful, q)) continue;
+            long below = longestAccepted(nfa, useful, q, color, longest);
+            if (below == -1) return -1;
+            if (below >= 0 && below + 1 > best) best = below + 1;
+        }
+    }
+
+    color[state] = 2;
+    longest[state] = best;
+    return best;
+}
+
+// Derive length bounds and first/last/required/forbidden byte sets from
+// the trimmed automaton (states both reachable and co-reachable)
+void summarizeLanguage(BitNFA *nfa, LanguageSummary *summary) {
+    memset(summary, 0, sizeof(LanguageSummary));
+
+    StateBits reachable = nfa->start;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (int e = 0; e < nfa->edge_start[256]; e++) {
+            StateBits grown = reachable;
+            if (bitsTest(&reachable, nfa->edge_from[e])) {
+                grown.w[0] |= nfa->edge_to[e].w[0];
+                grown.w[1] |= nfa->edge_to[e].w[1];
+            }
+            if (!bitsEqual(&grown, &reachable)) {
+                reachable = grown;
+                changed = true;
+            }
+        }
+    }
+    StateBits live = coReachable(nfa, -1);
+    StateBits useful = {{reachable.w[0] & live.w[0], reachable.w[1] & live.w[1]}};
+
+    if (!bitsIntersect(&nfa->start, &live)) {
+        summary->empty = true;
+        memset(summary->forbidden, 0xff, sizeof(summary->forbidden));
+        return;
+    }
+
+    // Byte sets from the useful edges
+    uint64_t used[4] = {0};
+    for (int c = 1; c < 256; c++) {
+        for (int e = nfa->edge_start[c]; e < nfa->edge_start[c + 1]; e++) {
+            if (!bitsTest(&useful, nfa->edge_from[e]) || !bitsIntersect(&nfa->edge_to[e], &live)) {
+                continue;
+            }
+            byteSetAdd(used, (unsigned char)c);
+            if (bitsTest(&nfa->start, nfa->edge_from[e])) {
+                byteSetAdd(summary->first, (unsigned char)c);
+            }
+            if (bitsIntersect(&nfa->edge_to[e], &nfa->accepting)) {
+                byteSetAdd(summary->last, (unsigned char)c);
+            }
+        }
+    }
+    for (int w = 0; w < 4; w++) {
+        summary->forbidden[w] = ~used[w];
+    }
+
+    // A byte is required if dropping its edges cuts every accepting path
+    if (!bitsIntersect(&nfa->start, &nfa->accepting)) {
+        for (int c = 1; c < 256; c++) {
+            if (byteSetTest(used, (unsigned char)c)) {
+                StateBits without = coReachable(nfa, c);
+                if (!bitsIntersect(&nfa->start, &without)) {
+                    byteSetAdd(summary->required, (unsigned char)c);
+                }
+            }
+        }
+    }
+
+    // Shortest accepted length: breadth-first layers from the start set
+    StateBits layer = nfa->start;
+    for (size_t depth = 0; depth <= MAX_STATES; depth++) {
+        if (bitsIntersect(&layer, &nfa->accepting)) {
+            summary->min_length = depth;
+            break;
+        }
+        StateBits next = {{0, 0}};
+        for (int e = 0; e < nfa->edge_start[256]; e++) {
+            if (bitsTest(&layer, nfa->edge_from[e])) {
+                next.w[0] |= nfa->edge_to[e].w[0] & useful.w[0];
+                next.w[1] |= nfa->edge_to[e].w[1] & useful.w[1];
+            }
+        }
+        layer = next;
+    }
+
+    // Longest accepted length, unbounded if the useful part has a cycle
+    unsigned char color[MAX_STATES] = {0};
+    long longest[MAX_STATES];
+    long max_length = -2;
+    for (int q = 0; q < MAX_STATES && max_length != -1; q++) {
+        if (bitsTest(&nfa->start, q) && bitsTest(&useful, q)) {
+            long length = longestAccepted(nfa, &useful, q, color, longest);
+            if (length == -1 || length > max_length) max_length = length;
+        }
+    }
+    summary->max_length = max_length == -1 ? SUMMARY_UNBOUNDED : (size_t)max_length;
+
+#ifdef __SSSE3__
+    for (int b = 0; b < 256; b++) {
+        if (byteSetTest(summary->forbidden, (unsigned char)b)) {
+            unsigned char *table = b < 128 ? summary->forbidden_highclear
+                                           : summary->forbidden_highset;
+            table[b & 15] |= (unsigned char)(1 << ((b >> 4) & 7));
+        }
+    }
+#endif
+}
+
+// Check if any byte of input lies in the summary's forbidden set
+static bool containsForbidden(LanguageSummary *summary, const char *input, size_t length) {
+    size_t i = 0;
+#ifdef __SSSE3__
+    const __m128i highclear = _mm_loadu_si128((const __m128i *)summary->forbidden_highclear);
+    const __m128i highset = _mm_loadu_si128((const __m128i *)summary->forbidden_highset);
+    const __m128i bit_for_nibble = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+                                                 1, 2, 4, 8, 16, 32, 64, (char)128);
+    const __m128i high_bit = _mm_set1_epi8((char)0x80);
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(input + i));
+        // pshufb yields zero for lanes whose index has the top bit set, so
+        // each table only answers for its half of the byte range
+        __m128i rows = _mm_or_si128(_mm_shuffle_epi8(highclear, bytes),
+                                    _mm_shuffle_epi8(highset, _mm_xor_si128(bytes, high_bit)));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), low_nibble);
+        __m128i bits = _mm_shuffle_epi8(bit_for_nibble, high);
+        __m128i hit = _mm_cmpeq_epi8(_mm_and_si128(rows, bits), _mm_setzero_si128());
+        if (_mm_movemask_epi8(hit) != 0xffff) {
+            return true;
+        }
+    }
+#endif
+    for (; i < length; i++) {
+        if (byteSetTest(summary->forbidden, (unsigned char)input[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pre-check an input against a language summary. Returns false only if
+// the input certainly cannot be accepted.
+bool summaryMayAccept(LanguageSummary *summary, const char *input, size_t length) {
+    if (summary->empty || length < summary->min_length || length > summary->max_length) {
+        return false;
+    }
+    if (length > 0 && (!byteSetTest(summary->first, (unsigned char)input[0]) ||
+                       !byteSetTest(summary->last, (unsigned char)input[length - 1]))) {
+        return false;
+    }
+    for (int c = 1; c < 256; c++) {
+        if (byteSetTest(summary->required, (unsigned char)c) &&
+            memchr(input, c, length) == NULL) {
+            return false;
+        }
+    }
+    return !containsForbidden(summary, input, length);
+}
+
+// Pick an engine for fsa. Deterministic automata are compiled as they are;
+// NFAs whose estimated DFA fits in MAX_STATES are determinized up front;
+// larger ones start on the lazy DFA. Bit-parallel simulation is the
+// fallback when the lazy DFA thrashes, and plain NFA simulation is used
+// only if the other engines cannot be built.
+Matcher* matcherCreate(FSA *fsa) {
+    Matcher *m = (Matcher *)calloc(1, sizeof(Matcher));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->fsa = fsa;
+    m->engine = ENGINE_NFA;
+
+    m->bits = (BitNFA *)malloc(sizeof(BitNFA));
+    if (m->bits == NULL) {
+        return m;
+    }
+    buildBitNFA(fsa, m->bits);
+    automatonStats(fsa, m->bits, &m->stats);
+    summarizeLanguage(m->bits, &m->summary);
+    m->engine = ENGINE_BIT_PARALLEL;
+
+    if (m->stats.epsilon_density == 0.0 && deterministic(fsa)) {
+        m->compiled = compileDFA(fsa);
+    } else if (m->stats.estimated_dfa_states != -1) {
+        FSA *dfa = toDFA(fsa);
+        m->compiled = dfa != NULL ? compileDFA(dfa) : NULL;
+        free(dfa);
+    }
+    if (m->compiled != NULL) {
+        m->engine = ENGINE_DFA;
+        return m;
+    }
+
+    m->lazy = (LazyDFA *)malloc(sizeof(LazyDFA));
+    if (m->lazy != NULL) {
+        initLazyDFA(m->lazy, m->bits);
+        m->engine = ENGINE_LAZY_DFA;
+    }
+    return m;
+}
+
+// Match with the selected engine. Engines slower than the compiled DFA
+// are fronted by the language summary pre-check.
+static bool matcherRun(Matcher *m, const char *input) {
+    if (m->engine != ENGINE_DFA && m->engine != ENGINE_NFA &&
+        !summaryMayAccept(&m->summary, input, strlen(input))) {
+        return false;
+    }
+
+    switch (m->engine) {
+    case ENGINE_DFA:
+        return runCompiled(m->compiled, input);
+    case ENGINE_LAZY_DFA: {
+        bool result = acceptsLazy(m->lazy, input);
+        if (m->lazy->flushes >= LAZY_THRASH_MIN_FLUSHES &&
+            m->lazy->bytes / m->lazy->flushes < LAZY_THRASH_BYTES_PER_FLUSH) {
+            m->engine = ENGINE_BIT_PARALLEL;
+        }
+        return result;
+    }
+    case ENGINE_BIT_PARALLEL:
+        return acceptsBitParallel(m->bits, input);
+    default:
+        return simulateNFA(m->fsa, input);
+    }
+}
+
+// Check if the matcher's automaton accepts a given string
+bool matcherAccepts(Matcher *m, const char *input) {
+    if (!atomic_load_explicit(&latency_enabled, memory_order_relaxed)) {
+        return matcherRun(m, input);
+    }
+
+    Engine engine = m->engine;
+    uint64_t start = monotonicNanos();
+    bool result = matcherRun(m, input);
+    latencyRecord(engine, strlen(input), monotonicNanos() - start);
+    return result;
+}
+
+void freeMatcher(Matcher *m) {
+    if (m == NULL) return;
+    free(m->bits);
+    free(m->lazy);
+    freeCompiledDFA(m->compiled);
+    free(m);
+}
+
+// Create a result cache holding about capacity entries
+MatchCache* matchCacheCreate(int capacity) {
+    MatchCache *cache = (MatchCache *)calloc(1, sizeof(MatchCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->num_sets = (capacity + CACHE_WAYS - 1) / CACHE_WAYS;
+    if (cache->num_sets < 1) cache->num_sets = 1;
+    cache->entries = (CacheEntry *)calloc((size_t)cache->num_sets * CACHE_WAYS,
+                                          sizeof(CacheEntry));
+    cache->hands = (unsigned char *)calloc(cache->num_sets, 1);
+    if (cache->entries == NULL || cache->hands == NULL) {
+        free(cache->entries);
+        free(cache->hands);
+        free(cache);
+        return NULL;
+    }
+    for (int i = 0; i < CACHE_STRIPES; i++) {
+        pthread_mutex_init(&cache->locks[i], NULL);
+    }
+    return cache;
+}
+
+// Word-at-a-time hash of an input
+static uint64_t hashInput(const char *input, size_t length) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, input + i, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, input + i, length - i);
+    hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 29);
+}
+
+static CacheEntry* cacheFind(CacheEntry *set, uint64_t hash, uint64_t version,
+                             const char *input, size_t length) {
+    for (int w = 0; w < CACHE_WAYS; w++) {
+        CacheEntry *entry = &set[w];
+        if (entry->input != NULL && entry->hash == hash && entry->version == version &&
+            entry->length == length && memcmp(entry->input, input, length) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Look input up in the cache and fall back to match(automaton, input) on a
+// miss. version must change whenever the automaton does (fsaVersion or
+// CompiledDFA.version). The engine runs outside the lock.
+bool cachedAccepts(MatchCache *cache, MatchFunction match, void *automaton,
+                   uint64_t version, const char *input) {
+    size_t length = strlen(input);
+    uint64_t hash = hashInput(input, length) ^ version;
+    int set_index = (int)(hash % (uint64_t)cache->num_sets);
+    CacheEntry *set = &cache->entries[(size_t)set_index * CACHE_WAYS];
+    pthread_mutex_t *lock = &cache->locks[set_index % CACHE_STRIPES];
+
+    pthread_mutex_lock(lock);
+    CacheEntry *entry = cacheFind(set, hash, version, input, length);
+    if (entry != NULL) {
+        bool result = entry->result;
+        entry->referenced = true;
+        pthread_mutex_unlock(lock);
+        atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+        return result;
+    }
+    pthread_mutex_unlock(lock);
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+
+    bool result = match(automaton, input);
+    char *copy = (char *)malloc(length ? length : 1);
+    if (copy == NULL) {
+        return result;
+    }
+    memcpy(copy, input, length);
+
+    pthread_mutex_lock(lock);
+    if (cacheFind(set, hash, version, input, length) != NULL) {
+        // Another thread cached it meanwhile
+        pthread_mutex_unlock(lock);
+        free(copy);
+        return result;
+    }
+
+    // CLOCK: skip recently referenced entries, clearing their bits
+    int hand = cache->hands[set_index];
+    while (set[hand].input != NULL && set[hand].referenced) {
+        set[hand].referenced = false;
+        hand = (hand + 1) % CACHE_WAYS;
+    }
+    entry = &set[hand];
+    char *evicted = entry->input;
+    *entry = (CacheEntry){hash, version, copy, length, result, false};
+    cache->hands[set_index] = (unsigned char)((hand + 1) % CACHE_WAYS);
+    pthread_mutex_unlock(lock);
+
+    if (evicted != NULL) {
+        free(evicted);
+        atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+    }
+    return result;
+}
+
+// Read the cache's hit, miss and eviction counters
+void matchCacheStats(MatchCache *cache, uint64_t *hits, uint64_t *misses, uint64_t *evictions) {
+    *hits = atomic_load(&cache->hits);
+    *misses = atomic_load(&cache->misses);
+    *evictions = atomic_load(&cache->evictions);
+}
+
+void freeMatchCache(MatchCache *cache) {
+    if (cache == NULL) return;
+    for (size_t i = 0; i < (size_t)cache->num_sets * CACHE_WAYS; i++) {
+        free(cache->entries[i].input);
+    }
+    for (int i = 0; i < CACHE_STRIPES; i++) {
+        pthread_mutex_destroy(&cache->locks[i]);
+    }
+    free(cache->entries);
+    free(cache->hands);
+    free(cache);
+}
+
+// MatchFunction adapters for the engines
+bool matchWithFSA(void *fsa, const char *input) {
+    return accepts((FSA *)fsa, input);
+}
+
+bool matchWithCompiled(void *dfa, const char *input) {
+    return acceptsCompiled((CompiledDFA *)dfa, input);
+}
+
+bool matchWithMatcher(void *m, const char *input) {
+    return matcherAccepts((Matcher *)m, input);
+}
+
+// Epsilon closure of state with the capture slots set along the path to
+// each member. Fails if some state is reachable along paths that set
+// different slots, since the captures would then be ambiguous.
+static bool taggedClosure(FSA *fsa, int state, StateSet *members, uint32_t masks[MAX_STATES]) {
+    StateSet stack = {.size = 0};
+    members->size = 0;
+    addToStateSet(members, state);
+    addToStateSet(&stack, state);
+    masks[state] = 0;
+
+    while (stack.size > 0) {
+        int current = stack.states[--stack.size];
+        for (int i = 0; i < fsa->num_transitions; i++) {
+            Transition *t = &fsa->transitions[i];
+            if (t->from_state != current || t->symbol != EPSILON) {
+                continue;
+            }
+            uint32_t mask = masks[current] | (t->tag != NO_TAG ? 1u << t->tag : 0);
+            if (stateSetContains(members, t->to_state)) {
+                if (masks[t->to_state] != mask) {
+                    return false;
+                }
+                continue;
+            }
+            masks[t->to_state] = mask;
+            addToStateSet(members, t->to_state);
+            addToStateSet(&stack, t->to_state);
+        }
+    }
+    return true;
+}
+
+// Build a one-pass DFA, or return NULL if the FSA is not one-pass: from
+// every state, each byte (and acceptance) must be reachable along at most
+// one path, so at most one thread can continue at each step.
+OnePassDFA* buildOnePass(FSA *fsa) {
+    int start_state = -1;
+    for (int i = 0; i < fsa->num_states; i++) {
+        if (fsa->is_start[fsa->states[i]]) {
+            start_state = fsa->states[i];
+            break;
+        }
+    }
+    if (start_state == -1) {
+        return NULL;
+    }
+
+    // One-pass states: the start state and every symbol target
+    int index[MAX_STATES];
+    int origin[MAX_STATES];
+    int num_states = 0;
+    for (int i = 0; i < MAX_STATES; i++) {
+        index[i] = ONEPASS_DEAD;
+    }
+    index[start_state] = num_states;
+    origin[num_states++] = start_state;
+    for (int i = 0; i < fsa->num_transitions; i++) {
+        Transition *t = &fsa->transitions[i];
+        if (t->symbol != EPSILON && index[t->to_state] == ONEPASS_DEAD) {
+            index[t->to_state] = num_states;
+            origin[num_states++] = t->to_state;
+        }
+    }
+
+    OnePassDFA *dfa = (OnePassDFA *)calloc(1, sizeof(OnePassDFA));
+    if (dfa == NULL) {
+        return NULL;
+    }
+    dfa->num_states = num_states;
+    dfa->start = 0;
+    dfa->table = (OnePassEdge *)malloc(sizeof(OnePassEdge) * 256 * num_states);
+    dfa->accepting = (bool *)calloc(num_states, sizeof(bool));
+    dfa->accept_slots = (uint32_t *)calloc(num_states, sizeof(uint32_t));
+    if (dfa->table == NULL || dfa->accepting == NULL || dfa->accept_slots == NULL) {
+        freeOnePass(dfa);
+        return NULL;
+    }
+    for (int i = 0; i < 256 * num_states; i++) {
+        dfa->table[i] = (OnePassEdge){ONEPASS_DEAD, 0};
+    }
+
+    for (int i = 0; i < fsa->num_transitions; i++) {
+        if (fsa->transitions[i].tag >= dfa->num_slots) {
+            dfa->num_slots = fsa->transitions[i].tag + 1;
+        }
+    }
+
+    for (int q = 0; q < num_states; q++) {
+        StateSet members;
+        uint32_t masks[MAX_STATES];
+        if (!taggedClosure(fsa, origin[q], &members, masks)) {
+            freeOnePass(dfa);
+            return NULL;
+        }
+
+        for (int m = 0; m < members.size; m++) {
+            int p = members.states[m];
+            if (fsa->is_accepting[p]) {
+                if (dfa->accepting[q] && dfa->accept_slots[q] != masks[p]) {
+                    freeOnePass(dfa);
+                    return NULL;
+                }
+                dfa->accepting[q] = true;
+                dfa->accept_slots[q] = masks[p];
+            }
+
+            for (int i = 0; i < fsa->num_transitions; i++) {
+                Transition *t = &fsa->transitions[i];
+                if (t->from_state != p || t->symbol == EPSILON) {
+                    continue;
+                }
+                OnePassEdge *edge = &dfa->table[q * 256 + (unsigned char)t->symbol];
+                OnePassEdge wanted = {index[t->to_state], masks[p]};
+                if (edge->next != ONEPASS_DEAD &&
+                    (edge->next != wanted.next || edge->slots != wanted.slots)) {
+                    freeOnePass(dfa);
+                    return NULL;
+                }
+                *edge = wanted;
+            }
+        }
+    }
+
+    return dfa;
+}
+
+// Match input and extract captures in a single pass. slots must hold
+// dfa->num_slots entries; unset slots are -1. Returns false (leaving the
+// slots unspecified) if the input is rejected.
+bool onePassCaptures(OnePassDFA *dfa, const char *input, long *slots) {
+    for (int k = 0; k < dfa->num_slots; k++) {
+        slots[k] = -1;
+    }
+
+    int state = dfa->start;
+    long i = 0;
+    for (; input[i] != '\0'; i++) {
+        OnePassEdge edge = dfa->table[state * 256 + (unsigned char)input[i]];
+        if (edge.next == ONEPASS_DEAD) {
+            return false;
+        }
+        for (uint32_t mask = edge.slots; mask != 0; mask &= mask - 1) {
+            slots[__builtin_ctz(mask)] = i;
+        }
+        state = edge.next;
+    }
+
+    if (!dfa->accepting[state]) {
+        return false;
+    }
+    for (uint32_t mask = dfa->accept_slots[state]; mask != 0; mask &= mask - 1) {
+        slots[__builtin_ctz(mask)] = i;
+    }
+    return true;
+}
+
+void freeOnePass(OnePassDFA *dfa) {
+    if (dfa == NULL) return;
+    free(dfa->table);
+    free(dfa->accepting);
+    free(dfa->accept_slots);
+    free(dfa);
+}
+
+// Transition-count matrix of a compiled DFA without its dead row:
+// matrix[i * k + j] is the number of bytes leading from live state i to j.
+// Returns k, and the live index of the start state in *start (-1 if dead).
+static int countMatrix(CompiledDFA *dfa, uint64_t **matrix, int *start, bool **accepting) {
+    int k = dfa->num_states - 1;
+    *matrix = (uint64_t *)calloc((size_t)k * k + 1, sizeof(uint64_t));
+    *accepting = (bool *)calloc(k + 1, sizeof(bool));
+    if (*matrix == NULL || *accepting == NULL) {
+        free(*matrix);
+        free(*accepting);
+        return -1;
+    }
+
+    int dead_row = dfa->dead / 256;
+    for (int r = 0; r < dfa->num_states; r++) {
+        if (r == dead_row) continue;
+        int i = r < dead_row ? r : r - 1;
+        (*accepting)[i] = compiledAccepting(dfa, r * 256);
+        for (int c = 0; c < 256; c++) {
+            int to = dfa->table[r * 256 + c] / 256;
+            if (to != dead_row) {
+                (*matrix)[i * k + (to < dead_row ? to : to - 1)]++;
+            }
+        }
+    }
+
+    int start_row = dfa->start / 256;
+    *start = start_row == dead_row ? -1 : start_row < dead_row ? start_row : start_row - 1;
+    return k;
+}
+
+static inline uint64_t mulMod(uint64_t a, uint64_t b, uint64_t modulus) {
+    return (uint64_t)((unsigned __int128)a * b % modulus);
+}
+
+// product = a * b for k x k matrices modulo modulus
+static void matrixMulMod(const uint64_t *a, const uint64_t *b, uint64_t *product, int k,
+                         uint64_t modulus) {
+    for (int i = 0; i < k; i++) {
+        for (int j = 0; j < k; j++) {
+            unsigned __int128 sum = 0;
+            for (int l = 0; l < k; l++) {
+                sum = (sum + (unsigned __int128)a[i * k + l] * b[l * k + j]) % modulus;
+            }
+            product[i * k + j] = (uint64_t)sum;
+        }
+    }
+}
+
+// Number of accepted strings of length n modulo modulus, by raising the
+// transition-count matrix to the n-th power (O(k^3 log n)). A zero
+// modulus is rejected with 0.
+uint64_t countAcceptedMod(CompiledDFA *dfa, uint64_t n, uint64_t modulus) {
+    if (modulus == 0) {
+        return 0;
+    }
+    uint64_t *matrix;
+    bool *accepting;
+    int start;
+    int k = countMatrix(dfa, &matrix, &start, &accepting);
+    if (k <= 0 || start == -1) {
+        if (k >= 0) {
+            free(matrix);
+            free(accepting);
+        }
+        return 0;
+    }
+
+    uint64_t *power = (uint64_t *)malloc(sizeof(uint64_t) * k * k);
+    uint64_t *scratch = (uint64_t *)malloc(sizeof(uint64_t) * k * k);
+    uint64_t *row = (uint64_t *)calloc(k, sizeof(uint64_t));
+    uint64_t *next_row = (uint64_t *)malloc(sizeof(uint64_t) * k);
+    uint64_t count = 0;
+    if (power != NULL && scratch != NULL && row != NULL && next_row != NULL) {
+        for (int i = 0; i < k * k; i++) {
+            power[i] = matrix[i] % modulus;
+        }
+        row[start] = 1 % modulus;
+
+        // row = e_start * M^n, squaring the power matrix per bit of n
+        for (uint64_t bits = n; bits != 0; bits >>= 1) {
+            if (bits & 1) {
+                for (int j = 0; j < k; j++) {
+                    unsigned __int128 sum = 0;
+                    for (int l = 0; l < k; l++) {
+                        sum = (sum + (unsigned __int128)row[l] * power[l * k + j]) % modulus;
+                    }
+                    next_row[j] = (uint64_t)sum;
+                }
+                memcpy(row, next_row, sizeof(uint64_t) * k);
+            }
+            if (bits > 1) {
+                matrixMulMod(power, power, scratch, k, modulus);
+                memcpy(power, scratch, sizeof(uint64_t) * k * k);
+            }
+        }
+
+        for (int i = 0; i < k; i++) {
+            if (accepting[i]) {
+                count = (count + row[i]) % modulus;
+            }
+        }
+    }
+
+    free(power);
+    free(scratch);
+    free(row);
+    free(next_row);
+    free(matrix);
+    free(accepting);
+    return count;
+}
+
+// Arbitrary-precision unsigned integer, little-endian 32-bit limbs
+typedef struct {
+    uint32_t *limbs;
+    int size;
+} BigNum;
+
+// acc += a * b
+static bool bigMulAdd(BigNum *acc, const BigNum *a, const BigNum *b) {
+    if (a->size == 0 || b->size == 0) {
+        return true;
+    }
+
+    int size = (acc->size > a->size + b->size ? acc->size : a->size + b->size) + 1;
+    uint32_t *limbs = (uint32_t *)realloc(acc->limbs, sizeof(uint32_t) * size);
+    if (limbs == NULL) {
+        return false;
+    }
+    memset(limbs + acc->size, 0, sizeof(uint32_t) * (size - acc->size));
+    acc->limbs = limbs;
+
+    for (int i = 0; i < a->size; i++) {
+        uint64_t carry = 0;
+        int j = 0;
+        for (; j < b->size; j++) {
+            uint64_t t = (uint64_t)a->limbs[i] * b->limbs[j] + limbs[i + j] + carry;
+            limbs[i + j] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        for (int p = i + j; carry != 0; p++) {
+            uint64_t t = (uint64_t)limbs[p] + carry;
+            limbs[p] = (uint32_t)t;
+            carry = t >> 32;
+        }
+    }
+
+    acc->size = size;
+    while (acc->size > 0 && acc->limbs[acc->size - 1] == 0) {
+        acc->size--;
+    }
+    return true;
+}
+
+static void bigFreeAll(BigNum *nums, int count) {
+    for (int i = 0; i < count; i++) {
+        free(nums[i].limbs);
+    }
+    free(nums);
+}
+
+// product = a * b for k x k matrices of big numbers
+static bool bigMatrixMul(BigNum *a, BigNum *b, BigNum *product, int k) {
+    for (int i = 0; i < k * k; i++) {
+        product[i].size = 0;
+    }
+    for (int i = 0; i < k; i++) {
+        for (int l = 0; l < k; l++) {
+            for (int j = 0; j < k; j++) {
+                if (!bigMulAdd(&product[i * k + j], &a[i * k + l], &b[l * k + j])) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Decimal representation of a big number (malloc'd)
+static char* bigToDecimal(BigNum *num) {
+    // Each 32-bit limb needs fewer than 10 decimal digits
+    size_t capacity = (size_t)num->size * 10 + 2;
+    char *digits = (char *)malloc(capacity);
+    uint32_t *work = (uint32_t *)malloc(sizeof(uint32_t) * (num->size + 1));
+    if (digits == NULL || work == NULL) {
+        free(digits);
+        free(work);
+        return NULL;
+    }
+    memcpy(work, num->limbs, sizeof(uint32_t) * num->size);
+
+    size_t length = 0;
+    int size = num->size;
+    while (size > 0) {
+        uint64_t remainder = 0;
+        for (int i = size - 1; i >= 0; i--) {
+            uint64_t t = (remainder << 32) | work[i];
+            work[i] = (uint32_t)(t / 10);
+            remainder = t % 10;
+        }
+        digits[length++] = (char)('0' + remainder);
+        while (size > 0 && work[size - 1] == 0) {
+            size--;
+        }
+    }
+    if (length == 0) {
+        digits[length++] = '0';
+    }
+    for (size_t i = 0; i < length / 2; i++) {
+        char t = digits[i];
+        digits[i] = digits[length - 1 - i];
+        digits[length - 1 - i] = t;
+    }
+    digits[length] = '\0';
+
+    free(work);
+    return digits;
+}
+
+// Exact number of accepted strings of length n as a malloc'd decimal
+// string, by matrix exponentiation over big integers
+char* countAccepted(CompiledDFA *dfa, uint64_t n) {
+    uint64_t *matrix;
+    bool *accepting;
+    int start;
+    int k = countMatrix(dfa, &matrix, &start, &accepting);
+    if (k < 0) {
+        return NULL;
+    }
+
+    BigNum total = {NULL, 0};
+    BigNum *power = (BigNum *)calloc((size_t)k * k + 1, sizeof(BigNum));
+    BigNum *scratch = (BigNum *)calloc((size_t)k * k + 1, sizeof(BigNum));
+    BigNum *row = (BigNum *)calloc(k + 1, sizeof(BigNum));
+    BigNum *next_row = (BigNum *)calloc(k + 1, sizeof(BigNum));
+    BigNum one = {(uint32_t[]){1}, 1};
+    bool ok = power != NULL && scratch != NULL && row != NULL && next_row != NULL && start != -1;
+
+    for (int i = 0; ok && i < k * k; i++) {
+        BigNum entry = {(uint32_t[]){(uint32_t)matrix[i]}, matrix[i] != 0};
+        ok = bigMulAdd(&power[i], &entry, &one);
+    }
+    if (ok) {
+        ok = bigMulAdd(&row[start], &one, &one);
+    }
+
+    for (uint64_t bits = n; ok && bits != 0; bits >>= 1) {
+        if (bits & 1) {
+            for (int j = 0; ok && j < k; j++) {
+                next_row[j].size = 0;
+                for (int l = 0; ok && l < k; l++) {
+                    ok = bigMulAdd(&next_row[j], &row[l], &power[l * k + j]);
+                }
+            }
+            BigNum *t = row; row = next_row; next_row = t;
+        }
+        if (ok && bits > 1) {
+            ok = bigMatrixMul(power, power, scratch, k);
+            BigNum *t = power; power = scratch; scratch = t;
+        }
+    }
+
+    for (int i = 0; ok && i < k; i++) {
+        if (accepting[i]) {
+            ok = bigMulAdd(&total, &row[i], &one);
+        }
+    }
+    char *decimal = ok || start == -1 ? bigToDecimal(&total) : NULL;
+    free(total.limbs);
+
+    if (power) bigFreeAll(power, k * k);
+    if (scratch) bigFreeAll(scratch, k * k);
+    if (row) bigFreeAll(row, k);
+    if (next_row) bigFreeAll(next_row, k);
+    free(matrix);
+    free(accepting);
+    return decimal;
+}
+
+static uint64_t powMod(uint64_t base, uint64_t exponent, uint64_t modulus) {
+    uint64_t result = 1 % modulus;
+    for (base %= modulus; exponent != 0; exponent >>= 1) {
+        if (exponent & 1) result = mulMod(result, base, modulus);
+        base = mulMod(base, base, modulus);
+    }
+    return result;
+}
+
+// Find the shortest linear recurrence of the counts modulo a prime with
+// Berlekamp-Massey over the first 2k + 2 terms (the recurrence has order
+// at most k, the number of live states), and express it as a rational
+// generating function
+bool countGeneratingFunction(CompiledDFA *dfa, uint64_t prime, CountGenerating *gf) {
+    uint64_t *matrix;
+    bool *accepting;
+    int start;
+    int k = countMatrix(dfa, &matrix, &start, &accepting);
+    if (k < 0) {
+        return false;
+    }
+
+    memset(gf, 0, sizeof(CountGenerating));
+    gf->modulus = prime;
+    gf->denominator[0] = 1 % prime;
+    if (start == -1) {
+        free(matrix);
+        free(accepting);
+        return true;
+    }
+
+    // First terms by stepping the start vector through the matrix
+    int terms = 2 * k + 2;
+    uint64_t sequence[2 * MAX_STATES + 4];
+    uint64_t row[MAX_STATES + 1] = {0};
+    uint64_t next_row[MAX_STATES + 1];
+    row[start] = 1 % prime;
+    for (int n = 0; n < terms; n++) {
+        uint64_t count = 0;
+        for (int i = 0; i < k; i++) {
+            if (accepting[i]) count = (count + row[i]) % prime;
+        }
+        sequence[n] = count;
+        for (int j = 0; j < k; j++) {
+            unsigned __int128 sum = 0;
+            for (int l = 0; l < k; l++) {
+                sum = (sum + (unsigned __int128)row[l] * (matrix[l * k + j] % prime)) % prime;
+            }
+            next_row[j] = (uint64_t)sum;
+        }
+        memcpy(row, next_row, sizeof(uint64_t) * k);
+    }
+    free(matrix);
+    free(accepting);
+
+    // Berlekamp-Massey: connection polynomial C with C[0] = 1
+    uint64_t c[MAX_STATES + 2] = {1 % prime};
+    uint64_t b[MAX_STATES + 2] = {1 % prime};
+    uint64_t saved[MAX_STATES + 2];
+    int length = 0;
+    int shift = 1;
+    uint64_t last_discrepancy = 1;
+    for (int n = 0; n < terms; n++) {
+        uint64_t discrepancy = sequence[n];
+        for (int i = 1; i <= length; i++) {
+            discrepancy = (discrepancy + mulMod(c[i], sequence[n - i], prime)) % prime;
+        }
+        if (discrepancy == 0) {
+            shift++;
+            continue;
+        }
+
+        uint64_t coef = mulMod(discrepancy, powMod(last_discrepancy, prime - 2, prime), prime);
+        memcpy(saved, c, sizeof(c));
+        for (int i = 0; i + shift <= k + 1; i++) {
+            c[i + shift] = (c[i + shift] + prime - mulMod(coef, b[i], prime)) % prime;
+        }
+        if (2 * length <= n) {
+            length = n + 1 - length;
+            memcpy(b, saved, sizeof(b));
+            last_discrepancy = discrepancy;
+            shift = 1;
+        } else {
+            shift++;
+        }
+    }
+
+    gf->order = length;
+    for (int i = 0; i <= length; i++) {
+        gf->denominator[i] = c[i];
+    }
+    // numerator = (sequence * denominator) truncated below x^order
+    for (int n = 0; n < length; n++) {
+        uint64_t sum = 0;
+        for (int i = 0; i <= n; i++) {
+            sum = (sum + mulMod(c[i], sequence[n - i], prime)) % prime;
+        }
+        gf->numerator[n] = sum;
+    }
+    return true;
+}
+
+// Fill counts[0..max_length] from a generating function's recurrence
+void countAcceptedUpTo(CountGenerating *gf, int max_length, uint64_t *counts) {
+    uint64_t p = gf->modulus;
+    for (int n = 0; n <= max_length; n++) {
+        // counts[n] = numerator[n] - sum_{j>=1} denominator[j] counts[n-j]
+        uint64_t value = n < gf->order ? gf->numerator[n] : 0;
+        for (int j = 1; j <= gf->order && j <= n; j++) {
+            value = (value + p - mulMod(gf->denominator[j], counts[n - j], p)) % p;
+        }
+        counts[n] = value;
+    }
+}
+
+// Copy a witness into a caller buffer, truncating to fit
+static void copyWitness(char *buf, size_t capacity, const char *path, size_t length) {
+    if (capacity == 0) return;
+    size_t n = length < capacity - 1 ? length : capacity - 1;
+    memcpy(buf, path, n);
+    buf[n] = '\0';
+}
+
+// Shortest accepted string (the lexicographically smallest among those of
+// minimal length) by breadth-first search over the compiled DFA. Returns
+// its length, or -1 if the language is empty. The string is written to
+// buf, truncated to capacity.
+long shortestAccepted(CompiledDFA *dfa, char *buf, size_t capacity) {
+    int rows = dfa->num_states;
+    int *parent = (int *)malloc(sizeof(int) * rows);
+    unsigned char *via = (unsigned char *)malloc(rows);
+    int *queue = (int *)malloc(sizeof(int) * rows);
+    long length = -1;
+    if (parent == NULL || via == NULL || queue == NULL) {
+        free(parent);
+        free(via);
+        free(queue);
+        return -1;
+    }
+
+    for (int r = 0; r < rows; r++) {
+        parent[r] = -2;
+    }
+    int head = 0, tail = 0;
+    int found = -1;
+    if (dfa->start != dfa->dead) {
+        parent[dfa->start / 256] = -1;
+        queue[tail++] = dfa->start / 256;
+    }
+
+    // Bytes are expanded in increasing order, so each row is first reached
+    // by its shortlex-smallest string
+    while (head < tail && found == -1) {
+        int row = queue[head++];
+        if (compiledAccepting(dfa, row * 256)) {
+            found = row;
+            break;
+        }
+        for (int c = 1; c < 256; c++) {
+            int next = dfa->table[row * 256 + c];
+            if (next != dfa->dead && parent[next / 256] == -2) {
+                parent[next / 256] = row;
+                via[next / 256] = (unsigned char)c;
+                queue[tail++] = next / 256;
+            }
+        }
+    }
+
+    if (found != -1) {
+        length = 0;
+        for (int r = found; parent[r] != -1; r = parent[r]) {
+            length++;
+        }
+        char *path = (char *)malloc((size_t)length + 1);
+        if (path != NULL) {
+            long i = length;
+            for (int r = found; parent[r] != -1; r = parent[r]) {
+                path[--i] = (char)via[r];
+            }
+            copyWitness(buf, capacity, path, (size_t)length);
+            free(path);
+        }
+    }
+
+    free(parent);
+    free(via);
+    free(queue);
+    return length;
+}
+
+// Start an enumeration of accepted strings up to max_length bytes
+WitnessIterator* witnessIterCreate(CompiledDFA *dfa, size_t max_length) {
+    WitnessIterator *it = (WitnessIterator *)calloc(1, sizeof(WitnessIterator));
+    if (it == NULL) {
+        return NULL;
+    }
+    it->dfa = dfa;
+    it->max_length = max_length;
+    it->capacity = 16;
+    it->finish = (StateBits *)calloc(it->capacity, sizeof(StateBits));
+    it->states = (int *)malloc(sizeof(int) * it->capacity);
+    it->next_byte = (int *)malloc(sizeof(int) * it->capacity);
+    it->path = (char *)malloc(it->capacity);
+    if (it->finish == NULL || it->states == NULL || it->next_byte == NULL || it->path == NULL) {
+        freeWitnessIter(it);
+        return NULL;
+    }
+
+    for (int r = 0; r < dfa->num_states; r++) {
+        if (compiledAccepting(dfa, r * 256)) {
+            bitsSet(&it->finish[0], r);
+        }
+    }
+    it->length = 0;
+    it->depth = bitsTest(&it->finish[0], dfa->start / 256) ? 0 : -1;
+    it->states[0] = dfa->start;
+    it->next_byte[0] = 1;
+    return it;
+}
+
+// Move the enumeration to the next length, extending finish by one level.
+// Returns false once no longer strings can be accepted, or with failed
+// set if the arrays could not grow.
+static bool witnessNextLength(WitnessIterator *it) {
+    CompiledDFA *dfa = it->dfa;
+    size_t length = it->length + 1;
+
+    StateBits level = {{0, 0}};
+    for (int r = 0; r < dfa->num_states; r++) {
+        for (int c = 1; c < 256; c++) {
+            int next = dfa->table[r * 256 + c];
+            if (next != dfa->dead && bitsTest(&it->finish[length - 1], next / 256)) {
+                bitsSet(&level, r);
+                break;
+            }
+        }
+    }
+    // No string of this length reaches an accepting state, so none longer
+    // does either: the language is exhausted
+    if (bitsEmpty(&level)) {
+        it->max_length = it->length;
+        return false;
+    }
+
+    if (length + 1 > it->capacity) {
+        size_t capacity = it->capacity * 2;
+        StateBits *finish = (StateBits *)realloc(it->finish, sizeof(StateBits) * capacity);
+        if (finish != NULL) it->finish = finish;
+        int *states = (int *)realloc(it->states, sizeof(int) * capacity);
+        if (states != NULL) it->states = states;
+        int *next_byte = (int *)realloc(it->next_byte, sizeof(int) * capacity);
+        if (next_byte != NULL) it->next_byte = next_byte;
+        char *path = (char *)realloc(it->path, capacity);
+        if (path != NULL) it->path = path;
+        if (finish == NULL || states == NULL || next_byte == NULL || path == NULL) {
+            it->failed = true;
+            return false;
+        }
+        it->capacity = capacity;
+    }
+
+    it->finish[length] = level;
+
+    it->length = length;
+    it->depth = bitsTest(&level, dfa->start / 256) ? 0 : -1;
+    it->next_byte[0] = 1;
+    return true;
+}
+
+// Produce the next accepted string in length-lexicographic order. Returns
+// its length (writing it to buf, truncated to capacity), -1 once every
+// string up to max_length has been produced, or -2 if memory ran out
+// before then.
+long witnessIterNext(WitnessIterator *it, char *buf, size_t capacity) {
+    CompiledDFA *dfa = it->dfa;
+
+    for (;;) {
+        if (it->failed) {
+            return -2;
+        }
+        if (it->depth < 0) {
+            if (it->length >= it->max_length) {
+                return -1;
+            }
+            if (!witnessNextLength(it)) {
+                return it->failed ? -2 : -1;
+            }
+            continue;
+        }
+
+        long d = it->depth;
+        if ((size_t)d == it->length) {
+            it->depth--;
+            copyWitness(buf, capacity, it->path, it->length);
+            return (long)it->length;
+        }
+
+        // Next byte at this depth that can still finish on time
+        int state = it->states[d];
+        StateBits *can_finish = &it->finish[it->length - d - 1];
+        int c = it->next_byte[d];
+        int next = dfa->dead;
+        for (; c < 256; c++) {
+            next = dfa->table[state + c];
+            if (next != dfa->dead && bitsTest(can_finish, next / 256)) {
+                break;
+            }
+        }
+        if (c == 256) {
+            it->depth--;
+            continue;
+        }
+
+        it->next_byte[d] = c + 1;
+        it->path[d] = (char)c;
+        it->states[d + 1] = next;
+        it->next_byte[d + 1] = 1;
+        it->depth++;
+    }
+}
+
+void freeWitnessIter(WitnessIterator *it) {
+    if (it == NULL) return;
+    free(it->finish);
+    free(it->states);
+    free(it->next_byte);
+    free(it->path);
+    free(it);
+}
+
+// Precompute path weights for drawing strings of exactly length bytes
+Sampler* samplerCreate(CompiledDFA *dfa, size_t length) {
+    int rows = dfa->num_states;
+    Sampler *sampler = (Sampler *)malloc(sizeof(Sampler));
+    if (sampler == NULL) {
+        return NULL;
+    }
+    sampler->dfa = dfa;
+    sampler->length = length;
+    sampler->weights = (double *)calloc((length + 1) * rows, sizeof(double));
+    if (sampler->weights == NULL) {
+        free(sampler);
+        return NULL;
+    }
+
+    for (int r = 0; r < rows; r++) {
+        sampler->weights[r] = compiledAccepting(dfa, r * 256) ? 1.0 : 0.0;
+    }
+    for (size_t level = 1; level <= length; level++) {
+        double *below = &sampler->weights[(level - 1) * rows];
+        double *here = &sampler->weights[level * rows];
+        double largest = 0.0;
+        for (int r = 0; r < rows; r++) {
+            double sum = 0.0;
+            for (int c = 1; c < 256; c++) {
+                sum += below[dfa->table[r * 256 + c] / 256];
+            }
+            here[r] = sum;
+            if (sum > largest) largest = sum;
+        }
+        if (largest > 0.0) {
+            for (int r = 0; r < rows; r++) {
+                here[r] /= largest;
+            }
+        }
+    }
+    return sampler;
+}
+
+// splitmix64 step
+static uint64_t nextRandom(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Draw one accepted string uniformly at random into buf (length + 1
+// bytes). Returns false if no string of that length is accepted.
+bool samplerDraw(Sampler *sampler, uint64_t *rng, char *buf) {
+    CompiledDFA *dfa = sampler->dfa;
+    int rows = dfa->num_states;
+    int state = dfa->start;
+    if (sampler->weights[sampler->length * rows + state / 256] == 0.0) {
+        return false;
+    }
+
+    for (size_t i = 0; i < sampler->length; i++) {
+        double *below = &sampler->weights[(sampler->length - i - 1) * rows];
+        const int *row = &dfa->table[state];
+        double total = 0.0;
+        for (int c = 1; c < 256; c++) {
+            total += below[row[c] / 256];
+        }
+
+        double pick = (double)(nextRandom(rng) >> 11) * 0x1p-53 * total;
+        int chosen = 0;
+        for (int c = 1; c < 256; c++) {
+            double weight = below[row[c] / 256];
+            if (weight > 0.0) {
+                chosen = c;
+                if (pick < weight) break;
+                pick -= weight;
+            }
+        }
+        buf[i] = (char)chosen;
+        state = row[chosen];
+    }
+    buf[sampler->length] = '\0';
+    return true;
+}
+
+// Per-thread slice of samplerBulk
+typedef struct {
+    Sampler *sampler;
+    char *out;
+    size_t count;
+    uint64_t seed;
+} SamplerJob;
+
+static void* runSamplerJob(void *arg) {
+    SamplerJob *job = (SamplerJob *)arg;
+    uint64_t rng = job->seed;
+    for (size_t i = 0; i < job->count; i++) {
+        samplerDraw(job->sampler, &rng, job->out + i * (job->sampler->length + 1));
+    }
+    return NULL;
+}
+
+// Draw count strings on several threads into out, which holds count
+// NUL-terminated strings of length + 1 bytes each. Returns the number of
+// strings written (0 if no string of that length is accepted).
+size_t samplerBulk(Sampler *sampler, size_t count, int threads, uint64_t seed, char *out) {
+    int rows = sampler->dfa->num_states;
+    if (sampler->weights[sampler->length * rows + sampler->dfa->start / 256] == 0.0) {
+        return 0;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > 64) threads = 64;
+
+    SamplerJob jobs[64];
+    pthread_t ids[64];
+    bool started[64];
+    size_t first = 0;
+    for (int t = 0; t < threads; t++) {
+        size_t share = count / threads + ((size_t)t < count % threads);
+        jobs[t] = (SamplerJob){sampler, out + first * (sampler->length + 1), share,
+                               seed + (uint64_t)t * 0xd1b54a32d192ed03ull};
+        started[t] = pthread_create(&ids[t], NULL, runSamplerJob, &jobs[t]) == 0;
+        if (!started[t]) {
+            runSamplerJob(&jobs[t]);
+        }
+        first += share;
+    }
+    for (int t = 0; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(ids[t], NULL);
+        }
+    }
+    return count;
+}
+
+void freeSampler(Sampler *sampler) {
+    if (sampler == NULL) return;
+    free(sampler->weights);
+    free(sampler);
+}
+
+static double semiringZero(Semiring semiring) {
+    return semiring == SEMIRING_PROBABILITY ? 0.0 : INFINITY;
+}
+
+static double semiringOne(Semiring semiring) {
+    return semiring == SEMIRING_PROBABILITY ? 1.0 : 0.0;
+}
+
+static double semiringPlus(Semiring semiring, double a, double b) {
+    switch (semiring) {
+    case SEMIRING_TROPICAL:
+        return a < b ? a : b;
+    case SEMIRING_LOG: {
+        if (a == INFINITY) return b;
+        if (b == INFINITY) return a;
+        double low = a < b ? a : b;
+        return low - log1p(exp(-fabs(a - b)));
+    }
+    default:
+        return a + b;
+    }
+}
+
+static double semiringTimes(Semiring semiring, double a, double b) {
+    return semiring == SEMIRING_PROBABILITY ? a * b : a + b;
+}
+
+// a divided by b, i.e. the x with b * x = a
+static double semiringDivide(Semiring semiring, double a, double b) {
+    return semiring == SEMIRING_PROBABILITY ? a / b : a - b;
+}
+
+void initWeightedFSA(WeightedFSA *wfsa, Semiring semiring) {
+    initFSA(&wfsa->base);
+    wfsa->semiring = semiring;
+    wfsa->compiled = false;
+    for (int i = 0; i < MAX_STATES; i++) {
+        wfsa->final_weight[i] = semiringOne(semiring);
+    }
+}
+
+// Add a weighted symbol transition (states are added with addState on
+// wfsa->base)
+void addWeightedTransition(WeightedFSA *wfsa, int from, int to, char symbol, double weight) {
+    if (wfsa->base.num_transitions < MAX_TRANSITIONS) {
+        wfsa->weights[wfsa->base.num_transitions] = weight;
+        addTransition(&wfsa->base, from, to, symbol);
+        wfsa->compiled = false;
+    }
+}
+
+// Set the final weight of an accepting state (semiring one by default)
+void setFinalWeight(WeightedFSA *wfsa, int state, double weight) {
+    wfsa->final_weight[state] = weight;
+}
+
+// Lay the edges out by symbol for weightedScore. Fails on epsilon edges.
+bool weightedCompile(WeightedFSA *wfsa) {
+    FSA *base = &wfsa->base;
+    int counts[257] = {0};
+    for (int i = 0; i < base->num_transitions; i++) {
+        if (base->transitions[i].symbol == EPSILON) {
+            return false;
+        }
+        counts[(unsigned char)base->transitions[i].symbol + 1]++;
+    }
+    for (int c = 0; c < 256; c++) {
+        counts[c + 1] += counts[c];
+    }
+    memcpy(wfsa->edge_start, counts, sizeof(counts));
+
+    for (int i = 0; i < base->num_transitions; i++) {
+        Transition *t = &base->transitions[i];
+        int e = counts[(unsigned char)t->symbol]++;
+        wfsa->edge_from[e] = t->from_state;
+        wfsa->edge_to[e] = t->to_state;
+        wfsa->edge_weight[e] = wfsa->weights[i];
+    }
+    wfsa->compiled = true;
+    return true;
+}
+
+// Total weight of input: the semiring sum over accepting paths of the
+// product of their weights (the best path cost in the tropical semiring).
+// Each step first computes every edge's contribution in a gather loop the
+// compiler can vectorize, then folds them into the target states. An
+// uncompiled wfsa is compiled in place first, so call weightedCompile
+// before scoring one from several threads.
+double weightedScore(WeightedFSA *wfsa, const char *input) {
+    Semiring semiring = wfsa->semiring;
+    double zero = semiringZero(semiring);
+    if (!wfsa->compiled && !weightedCompile(wfsa)) {
+        return zero;
+    }
+
+    double alpha[MAX_STATES];
+    double next[MAX_STATES];
+    double contribution[MAX_TRANSITIONS];
+    for (int q = 0; q < MAX_STATES; q++) {
+        alpha[q] = zero;
+    }
+    for (int i = 0; i < wfsa->base.num_states; i++) {
+        if (wfsa->base.is_start[wfsa->base.states[i]]) {
+            alpha[wfsa->base.states[i]] = semiringOne(semiring);
+            break;
+        }
+    }
+
+    for (int i = 0; input[i] != '\0'; i++) {
+        unsigned char c = (unsigned char)input[i];
+        int first = wfsa->edge_start[c];
+        int count = wfsa->edge_start[c + 1] - first;
+        const int *from = &wfsa->edge_from[first];
+        const int *to = &wfsa->edge_to[first];
+        const double *weight = &wfsa->edge_weight[first];
+
+        if (semiring == SEMIRING_PROBABILITY) {
+            for (int e = 0; e < count; e++) {
+                contribution[e] = alpha[from[e]] * weight[e];
+            }
+        } else {
+            for (int e = 0; e < count; e++) {
+                contribution[e] = alpha[from[e]] + weight[e];
+            }
+        }
+
+        for (int q = 0; q < MAX_STATES; q++) {
+            next[q] = zero;
+        }
+        switch (semiring) {
+        case SEMIRING_TROPICAL:
+            for (int e = 0; e < count; e++) {
+                if (contribution[e] < next[to[e]]) next[to[e]] = contribution[e];
+            }
+            break;
+        case SEMIRING_PROBABILITY:
+            for (int e = 0; e < count; e++) {
+                next[to[e]] += contribution[e];
+            }
+            break;
+        default:
+            for (int e = 0; e < count; e++) {
+                next[to[e]] = semiringPlus(semiring, next[to[e]], contribution[e]);
+            }
+            break;
+        }
+        memcpy(alpha, next, sizeof(alpha));
+    }
+
+    double total = zero;
+    for (int i = 0; i < wfsa->base.num_states; i++) {
+        int q = wfsa->base.states[i];
+        if (wfsa->base.is_accepting[q]) {
+            total = semiringPlus(semiring, total,
+                                 semiringTimes(semiring, alpha[q], wfsa->final_weight[q]));
+        }
+    }
+    return total;
+}
+
+// Residual weights of a weighted subset; zero marks absent states
+typedef struct {
+    double residual[MAX_STATES];
+} WeightedSubset;
+
+static bool weightedSubsetEqual(Semiring semiring, WeightedSubset *a, WeightedSubset *b) {
+    double zero = semiringZero(semiring);
+    for (int q = 0; q < MAX_STATES; q++) {
+        double x = a->residual[q], y = b->residual[q];
+        if ((x == zero) != (y == zero)) return false;
+        if (x != zero && fabs(x - y) > 1e-9 * (1.0 + fabs(x))) return false;
+    }
+    return true;
+}
+
+// Weighted subset construction (Mohri). Each DFA state is a set of NFA
+// states with residual weights; a transition carries the semiring sum of
+// the weights leaving it on that symbol, and the residuals are divided by
+// it. This terminates for automata with the twins property; otherwise
+// NULL is returned once MAX_STATES subsets have been created. NULL is
+// also returned if the result would exceed MAX_TRANSITIONS. The result
+// is already compiled, so it can be scored from several threads.
+WeightedFSA* weightedDeterminize(WeightedFSA *wfsa) {
+    Semiring semiring = wfsa->semiring;
+    double zero = semiringZero(semiring);
+    FSA *base = &wfsa->base;
+    for (int i = 0; i < base->num_transitions; i++) {
+        if (base->transitions[i].symbol == EPSILON) {
+            return NULL;
+        }
+    }
+
+    WeightedFSA *dfa = (WeightedFSA *)malloc(sizeof(WeightedFSA));
+    WeightedSubset *subsets = (WeightedSubset *)malloc(sizeof(WeightedSubset) * MAX_STATES);
+    if (dfa == NULL || subsets == NULL) {
+        free(dfa);
+        free(subsets);
+        return NULL;
+    }
+    initWeightedFSA(dfa, semiring);
+
+    int num_subsets = 1;
+    for (int q = 0; q < MAX_STATES; q++) {
+        subsets[0].residual[q] = zero;
+    }
+    for (int i = 0; i < base->num_states; i++) {
+        if (base->is_start[base->states[i]]) {
+            subsets[0].residual[base->states[i]] = semiringOne(semiring);
+            break;
+        }
+    }
+
+    for (int current = 0; current < num_subsets; current++) {
+        WeightedSubset *subset = &subsets[current];
+
+        // Final weight: sum of residual times final weight
+        double final_weight = zero;
+        for (int i = 0; i < base->num_states; i++) {
+            int q = base->states[i];
+            if (base->is_accepting[q] && subset->residual[q] != zero) {
+                final_weight = semiringPlus(semiring, final_weight,
+                                            semiringTimes(semiring, subset->residual[q],
+                                                          wfsa->final_weight[q]));
+            }
+        }
+        addState(&dfa->base, current, current == 0, final_weight != zero);
+        dfa->final_weight[current] = final_weight;
+
+        for (int c = 1; c < 256; c++) {
+            WeightedSubset next;
+            double total = zero;
+            bool any = false;
+            for (int q = 0; q < MAX_STATES; q++) {
+                next.residual[q] = zero;
+            }
+            for (int i = 0; i < base->num_transitions; i++) {
+                Transition *t = &base->transitions[i];
+                if ((unsigned char)t->symbol != c || subset->residual[t->from_state] == zero) {
+                    continue;
+                }
+                double w = semiringTimes(semiring, subset->residual[t->from_state], wfsa->weights[i]);
+                next.residual[t->to_state] = semiringPlus(semiring, next.residual[t->to_state], w);
+                total = semiringPlus(semiring, total, w);
+                any = true;
+            }
+            if (!any || total == zero) {
+                continue;
+            }
+            for (int q = 0; q < MAX_STATES; q++) {
+                if (next.residual[q] != zero) {
+                    next.residual[q] = semiringDivide(semiring, next.residual[q], total);
+                }
+            }
+
+            int target = -1;
+            for (int k = 0; k < num_subsets && target == -1; k++) {
+                if (weightedSubsetEqual(semiring, &subsets[k], &next)) {
+                    target = k;
+                }
+            }
+            if (target == -1) {
+                if (num_subsets == MAX_STATES) {
+                    free(dfa);
+                    free(subsets);
+                    return NULL;
+                }
+                subsets[num_subsets] = next;
+                target = num_subsets++;
+            }
+            if (dfa->base.num_transitions == MAX_TRANSITIONS) {
+                free(dfa);
+                free(subsets);
+                return NULL;
+            }
+            addWeightedTransition(dfa, current, target, (char)c, total);
+        }
+    }
+
+    free(subsets);
+    weightedCompile(dfa);
+    return dfa;
+}
+
+// Build a transducer that replaces every occurrence of patterns[i] with
+// replacements[i] in one pass. The states are the Aho-Corasick automaton
+// of the patterns: the pending bytes are always the trie path of the
+// current state, so on a mismatch the edge releases the bytes that fell
+// off the front, and on a match it releases the bytes before the match and
+// writes the replacement. Matches are taken as soon as they end and do not
+// overlap. Returns NULL for empty patterns or ones longer than
+// TRANSDUCER_MAX_HOLD.
+Transducer* redactionTransducer(const char **patterns, const char **replacements, int count) {
+    size_t total = 1;
+    for (int i = 0; i < count; i++) {
+        size_t length = strlen(patterns[i]);
+        if (length == 0 || length > TRANSDUCER_MAX_HOLD) {
+            return NULL;
+        }
+        total += length;
+    }
+
+    Transducer *transducer = (Transducer *)malloc(sizeof(Transducer));
+    int *go = (int *)malloc(sizeof(int) * total * 256);
+    int *fail = (int *)malloc(sizeof(int) * total);
+    int *depth = (int *)malloc(sizeof(int) * total);
+    int *match = (int *)malloc(sizeof(int) * total);
+    int *queue = (int *)malloc(sizeof(int) * total);
+    if (transducer == NULL || go == NULL || fail == NULL || depth == NULL ||
+        match == NULL || queue == NULL) {
+        free(transducer);
+        free(go);
+        free(fail);
+        free(depth);
+        free(match);
+        free(queue);
+        return NULL;
+    }
+
+    // Trie of the patterns; match[] holds the pattern ending at a node
+    int num_states = 1;
+    for (int c = 0; c < 256; c++) {
+        go[c] = -1;
+    }
+    depth[0] = 0;
+    match[0] = NO_OUTPUT;
+    for (int i = 0; i < count; i++) {
+        int node = 0;
+        for (const char *p = patterns[i]; *p != '\0'; p++) {
+            int *slot = &go[node * 256 + (unsigned char)*p];
+            if (*slot == -1) {
+                for (int c = 0; c < 256; c++) {
+                    go[num_states * 256 + c] = -1;
+                }
+                depth[num_states] = depth[node] + 1;
+                match[num_states] = NO_OUTPUT;
+                *slot = num_states++;
+            }
+            node = *slot;
+        }
+        if (match[node] == NO_OUTPUT) {
+            match[node] = i;
+        }
+    }
+
+    // Breadth-first failure links turn the trie into a complete DFA. A
+    // node without a pattern of its own inherits the one its failure link
+    // ends with, which is the longest pattern that is a suffix of it.
+    int head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        if (go[c] == -1) {
+            go[c] = 0;
+        } else {
+            fail[go[c]] = 0;
+            queue[tail++] = go[c];
+        }
+    }
+    while (head < tail) {
+        int node = queue[head++];
+        if (match[node] == NO_OUTPUT) {
+            match[node] = match[fail[node]];
+        }
+        for (int c = 0; c < 256; c++) {
+            int *slot = &go[node * 256 + c];
+            if (*slot == -1) {
+                *slot = go[fail[node] * 256 + c];
+            } else {
+                fail[*slot] = go[fail[node] * 256 + c];
+                queue[tail++] = *slot;
+            }
+        }
+    }
+
+    transducer->num_states = num_states;
+    transducer->num_outputs = count;
+    transducer->max_output = 0;
+    transducer->table = (TransducerEdge *)malloc(sizeof(TransducerEdge) * num_states * 256);
+    transducer->outputs = (char **)calloc(count > 0 ? count : 1, sizeof(char *));
+    transducer->output_lengths = (size_t *)malloc(sizeof(size_t) * (count > 0 ? count : 1));
+    bool ok = transducer->table != NULL && transducer->outputs != NULL &&
+              transducer->output_lengths != NULL;
+    for (int i = 0; ok && i < count; i++) {
+        size_t length = strlen(replacements[i]);
+        transducer->outputs[i] = (char *)malloc(length + 1);
+        if (transducer->outputs[i] == NULL) {
+            ok = false;
+            break;
+        }
+        memcpy(transducer->outputs[i], replacements[i], length + 1);
+        transducer->output_lengths[i] = length;
+        if (length > transducer->max_output) {
+            transducer->max_output = length;
+        }
+    }
+
+    for (int node = 0; ok && node < num_states; node++) {
+        for (int c = 0; c < 256; c++) {
+            int target = go[node * 256 + c];
+            TransducerEdge *edge = &transducer->table[node * 256 + c];
+            if (match[target] != NO_OUTPUT) {
+                size_t length = strlen(patterns[match[target]]);
+                edge->next = 0;
+                edge->release = (uint16_t)(depth[node] + 1 - length);
+                edge->output = (int16_t)match[target];
+            } else {
+                edge->next = target;
+                edge->release = (uint16_t)(depth[node] + 1 - depth[target]);
+                edge->output = NO_OUTPUT;
+            }
+        }
+    }
+    for (int c = 0; ok && c < 256; c++) {
+        transducer->passthrough[c] = transducer->table[c].next == 0 &&
+                                     transducer->table[c].output == NO_OUTPUT;
+    }
+
+    free(go);
+    free(fail);
+    free(depth);
+    free(match);
+    free(queue);
+    if (!ok) {
+        freeTransducer(transducer);
+        return NULL;
+    }
+    return transducer;
+}
+
+void transducerInit(TransducerStream *stream, Transducer *transducer) {
+    stream->transducer = transducer;
+    stream->state = 0;
+    stream->held = 0;
+}
+
+// Most bytes the next feed of `length` bytes can write: every input byte
+// releases at most itself or one replacement, plus the bytes already held
+size_t transducerOutputBound(TransducerStream *stream, size_t length) {
+    size_t per_byte = stream->transducer->max_output > 1 ? stream->transducer->max_output : 1;
+    return stream->held + length * per_byte;
+}
+
+// Rewrite the next chunk into out. Runs of passthrough bytes from the
+// start state are copied with memcpy; only bytes inside a possible match
+// go through the table. Returns the number of bytes written, or -1 without
+// consuming anything if capacity is below transducerOutputBound.
+long transducerFeed(TransducerStream *stream, const char *input, size_t length, char *out, size_t capacity) {
+    Transducer *transducer = stream->transducer;
+    if (capacity < transducerOutputBound(stream, length)) {
+        return -1;
+    }
+
+    const unsigned char *bytes = (const unsigned char *)input;
+    size_t written = 0;
+    size_t i = 0;
+    while (i < length) {
+        if (stream->state == 0) {
+            size_t run = i;
+            while (run < length && transducer->passthrough[bytes[run]]) {
+                run++;
+            }
+            memcpy(out + written, input + i, run - i);
+            written += run - i;
+            i = run;
+            if (i == length) {
+                break;
+            }
+        }
+
+        TransducerEdge edge = transducer->table[stream->state * 256 + bytes[i]];
+        stream->pending[stream->held++] = (char)bytes[i++];
+        memcpy(out + written, stream->pending, edge.release);
+        written += edge.release;
+        if (edge.output != NO_OUTPUT) {
+            memcpy(out + written, transducer->outputs[edge.output],
+                   transducer->output_lengths[edge.output]);
+            written += transducer->output_lengths[edge.output];
+            stream->held = 0;
+        } else {
+            stream->held -= edge.release;
+            memmove(stream->pending, stream->pending + edge.release, stream->held);
+        }
+        stream->state = edge.next;
+    }
+    return (long)written;
+}
+
+// End of stream: write out the bytes held for an unfinished match
+long transducerFinish(TransducerStream *stream, char *out, size_t capacity) {
+    if (capacity < stream->held) {
+        return -1;
+    }
+    size_t written = stream->held;
+    memcpy(out, stream->pending, written);
+    stream->held = 0;
+    stream->state = 0;
+    return (long)written;
+}
+
+void freeTransducer(Transducer *transducer) {
+    if (transducer == NULL) {
+        return;
+    }
+    if (transducer->outputs != NULL) {
+        for (int i = 0; i < transducer->num_outputs; i++) {
+            free(transducer->outputs[i]);
+        }
+    }
+    free(transducer->outputs);
+    free(transducer->output_lengths);
+    free(transducer->table);
+    free(transducer);
+}
+
+WindowMatcher* windowMatcherCreate(CompiledDFA *dfa, size_t window) {
+    WindowMatcher *wm = (WindowMatcher *)malloc(sizeof(WindowMatcher));
+    if (wm == NULL) {
+        return NULL;
+    }
+    int rows = dfa->num_states;
+    wm->dfa = dfa;
+    wm->window = window;
+    wm->count = 0;
+    wm->states = (int *)malloc(sizeof(int) * rows);
+    wm->next_states = (int *)malloc(sizeof(int) * rows);
+    wm->latest = (uint64_t *)malloc(sizeof(uint64_t) * rows);
+    wm->next_latest = (uint64_t *)malloc(sizeof(uint64_t) * rows);
+    wm->slot = (int *)malloc(sizeof(int) * rows);
+    if (wm->states == NULL || wm->next_states == NULL || wm->latest == NULL ||
+        wm->next_latest == NULL || wm->slot == NULL) {
+        freeWindowMatcher(wm);
+        return NULL;
+    }
+    for (int i = 0; i < rows; i++) {
+        wm->slot[i] = -1;
+    }
+    windowMatcherReset(wm);
+    return wm;
+}
+
+void windowMatcherReset(WindowMatcher *wm) {
+    for (int i = 0; i < wm->count; i++) {
+        wm->slot[wm->states[i] / 256] = -1;
+    }
+    wm->count = 0;
+    wm->offset = 0;
+}
+
+// Advance by one byte. Returns the start offset of the shortest match
+// ending after this byte that lies within the window, or -1. The work is
+// bounded by the number of live DFA states, not by the window size.
+long windowStep(WindowMatcher *wm, unsigned char c) {
+    CompiledDFA *dfa = wm->dfa;
+    uint64_t end = wm->offset + 1;
+    uint64_t oldest = end > wm->window ? end - wm->window : 0;
+
+    // A new run starts at this byte; it is the latest start by definition
+    int start_row = dfa->start / 256;
+    if (wm->slot[start_row] == -1) {
+        wm->slot[start_row] = wm->count;
+        wm->states[wm->count++] = dfa->start;
+    }
+    wm->latest[wm->slot[start_row]] = wm->offset;
+
+    for (int i = 0; i < wm->count; i++) {
+        wm->slot[wm->states[i] / 256] = -1;
+    }
+    int next_count = 0;
+    long match = -1;
+    for (int i = 0; i < wm->count; i++) {
+        if (wm->latest[i] < oldest) {
+            continue;
+        }
+        int next = dfa->table[wm->states[i] + c];
+        if (next == dfa->dead) {
+            continue;
+        }
+        int row = next / 256;
+        int k = wm->slot[row];
+        if (k == -1) {
+            k = wm->slot[row] = next_count++;
+            wm->next_states[k] = next;
+            wm->next_latest[k] = wm->latest[i];
+        } else if (wm->latest[i] > wm->next_latest[k]) {
+            wm->next_latest[k] = wm->latest[i];
+        }
+    }
+    for (int k = 0; k < next_count; k++) {
+        if (wm->next_states[k] >= dfa->accept_min && (long)wm->next_latest[k] > match) {
+            match = (long)wm->next_latest[k];
+        }
+    }
+
+    int *states = wm->states;
+    uint64_t *latest = wm->latest;
+    wm->states = wm->next_states;
+    wm->latest = wm->next_latest;
+    wm->next_states = states;
+    wm->next_latest = latest;
+    wm->count = next_count;
+    wm->offset = end;
+    return match;
+}
+
+// Feed a chunk; returns how many of its bytes end a match within the
+// window and stores the stream offset just past the last one in last_end
+size_t windowFeed(WindowMatcher *wm, const char *input, size_t length, uint64_t *last_end) {
+    size_t matches = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (windowStep(wm, (unsigned char)input[i]) != -1) {
+            matches++;
+            if (last_end != NULL) {
+                *last_end = wm->offset;
+            }
+        }
+    }
+    return matches;
+}
+
+void freeWindowMatcher(WindowMatcher *wm) {
+    if (wm == NULL) {
+        return;
+    }
+    free(wm->states);
+    free(wm->next_states);
+    free(wm->latest);
+    free(wm->next_latest);
+    free(wm->slot);
+    free(wm);
+}
+
+void initVPA(VPA *vpa) {
+    initFSA(&vpa->base);
+    for (int c = 0; c < 256; c++) {
+        vpa->kinds[c] = SYMBOL_INTERNAL;
+    }
+    vpa->num_calls = 0;
+    vpa->num_returns = 0;
+}
+
+void setSymbolKind(VPA *vpa, char symbol, SymbolKind kind) {
+    vpa->kinds[(unsigned char)symbol] = kind;
+}
+
+// Add a call transition that pushes stack symbol push
+void addCallTransition(VPA *vpa, int from, int to, char symbol, int push) {
+    if (vpa->num_calls < MAX_TRANSITIONS) {
+        CallTransition *t = &vpa->calls[vpa->num_calls++];
+        t->from_state = from;
+        t->to_state = to;
+        t->symbol = symbol;
+        t->push = push;
+    }
+}
+
+// Add a return transition taken when pop is on top of the stack
+void addReturnTransition(VPA *vpa, int from, int to, char symbol, int pop) {
+    if (vpa->num_returns < MAX_TRANSITIONS) {
+        ReturnTransition *t = &vpa->returns[vpa->num_returns++];
+        t->from_state = from;
+        t->to_state = to;
+        t->symbol = symbol;
+        t->pop = pop;
+    }
+}
+
+// Drop entries that reach nothing and hash what is left. Returns false
+// when no entry is left, i.e. the summary is dead.
+static bool finishSummary(VPASummary *summary) {
+    summary->hash = FNV_OFFSET;
+    for (int p = 0; p < MAX_STATES; p++) {
+        if (!bitsTest(&summary->entries, p)) {
+            continue;
+        }
+        if (bitsEmpty(&summary->reach[p])) {
+            summary->entries.w[p >> 6] &= ~(1ull << (p & 63));
+            continue;
+        }
+        summary->hash = fnv1a(summary->hash, &p, sizeof(int));
+        summary->hash = fnv1a(summary->hash, &summary->reach[p], sizeof(StateBits));
+    }
+    return !bitsEmpty(&summary->entries);
+}
+
+static void clearSummary(VPASummary *summary) {
+    memset(summary, 0, sizeof(VPASummary));
+}
+
+static bool summaryEqual(const VPASummary *a, const VPASummary *b) {
+    if (a->hash != b->hash || !bitsEqual(&a->entries, &b->entries)) {
+        return false;
+    }
+    for (int p = 0; p < MAX_STATES; p++) {
+        if (bitsTest(&a->entries, p) && !bitsEqual(&a->reach[p], &b->reach[p])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void vpaClearCaches(VPAMatcher *m) {
+    for (int i = 0; i < VPA_CACHE_STATES * 256; i++) {
+        m->next[i] = LAZY_UNKNOWN;
+    }
+    for (int i = 0; i < VPA_RETURN_SLOTS; i++) {
+        m->return_slots[i].current = VPA_REJECTED;
+    }
+}
+
+// Keep only the summaries the matcher still refers to (the initial one,
+// the current one and the stack), renumbering them in order
+static void vpaCompact(VPAMatcher *m) {
+    int remap[VPA_CACHE_STATES];
+    for (int i = 0; i < VPA_CACHE_STATES; i++) {
+        remap[i] = -1;
+    }
+    remap[m->initial] = 0;
+    if (m->state != VPA_REJECTED) {
+        remap[m->state] = 0;
+    }
+    for (int i = 0; i < m->depth; i++) {
+        remap[m->stack[i]] = 0;
+    }
+
+    // New ids never exceed old ones, so moving in increasing order is safe
+    int kept = 0;
+    for (int old = 0; old < m->num_summaries; old++) {
+        if (remap[old] != -1) {
+            remap[old] = kept;
+            m->summaries[kept++] = m->summaries[old];
+        }
+    }
+    m->initial = remap[m->initial];
+    if (m->state != VPA_REJECTED) {
+        m->state = remap[m->state];
+    }
+    for (int i = 0; i < m->depth; i++) {
+        m->stack[i] = remap[m->stack[i]];
+    }
+    m->num_summaries = kept;
+    vpaClearCaches(m);
+    m->compactions++;
+}
+
+// Id of a summary, adding it to the cache (compacting first if full)
+static int vpaIntern(VPAMatcher *m, const VPASummary *summary) {
+    for (int i = 0; i < m->num_summaries; i++) {
+        if (summaryEqual(&m->summaries[i], summary)) {
+            return i;
+        }
+    }
+    if (m->num_summaries == VPA_CACHE_STATES) {
+        vpaCompact(m);
+    }
+    m->summaries[m->num_summaries] = *summary;
+    return m->num_summaries++;
+}
+
+VPAMatcher* vpaMatcherCreate(VPA *vpa) {
+    int start = -1;
+    for (int i = 0; i < vpa->base.num_states; i++) {
+        if (vpa->base.is_start[vpa->base.states[i]]) {
+            start = vpa->base.states[i];
+            break;
+        }
+    }
+    for (int i = 0; i < vpa->base.num_transitions; i++) {
+        if (vpa->base.transitions[i].symbol == EPSILON) {
+            return NULL;
+        }
+    }
+    if (start == -1) {
+        return NULL;
+    }
+
+    VPAMatcher *m = (VPAMatcher *)malloc(sizeof(VPAMatcher));
+    if (m == NULL) {
+        return NULL;
+    }
+    m->vpa = vpa;
+    m->summaries = (VPASummary *)malloc(sizeof(VPASummary) * VPA_CACHE_STATES);
+    m->next = (int *)malloc(sizeof(int) * VPA_CACHE_STATES * 256);
+    m->return_slots = (VPAReturnSlot *)malloc(sizeof(VPAReturnSlot) * VPA_RETURN_SLOTS);
+    if (m->summaries == NULL || m->next == NULL || m->return_slots == NULL) {
+        freeVPAMatcher(m);
+        return NULL;
+    }
+    vpaClearCaches(m);
+    m->compactions = 0;
+    m->num_summaries = 0;
+    m->depth = 0;
+    m->state = VPA_REJECTED;
+
+    VPASummary initial;
+    clearSummary(&initial);
+    bitsSet(&initial.entries, start);
+    bitsSet(&initial.reach[start], start);
+    finishSummary(&initial);
+    m->summaries[0] = initial;
+    m->num_summaries = 1;
+    m->initial = 0;
+    vpaMatcherReset(m);
+    return m;
+}
+
+void vpaMatcherReset(VPAMatcher *m) {
+    m->state = m->initial;
+    m->depth = 0;
+    m->overflow = false;
+}
+
+// Internal move: advance every entry's reachable set on c
+static void vpaInternal(VPA *vpa, const VPASummary *from, unsigned char c, VPASummary *to) {
+    clearSummary(to);
+    to->entries = from->entries;
+    for (int i = 0; i < vpa->base.num_transitions; i++) {
+        Transition *t = &vpa->base.transitions[i];
+        if ((unsigned char)t->symbol != c) {
+            continue;
+        }
+        for (int p = 0; p < MAX_STATES; p++) {
+            if (bitsTest(&from->entries, p) && bitsTest(&from->reach[p], t->from_state)) {
+                bitsSet(&to->reach[p], t->to_state);
+            }
+        }
+    }
+}
+
+// Call move: the new level starts at every state a call on c can enter
+static void vpaCall(VPA *vpa, const VPASummary *from, unsigned char c, VPASummary *to) {
+    StateBits range = {{0, 0}};
+    for (int p = 0; p < MAX_STATES; p++) {
+        if (bitsTest(&from->entries, p)) {
+            range.w[0] |= from->reach[p].w[0];
+            range.w[1] |= from->reach[p].w[1];
+        }
+    }
+    clearSummary(to);
+    for (int i = 0; i < vpa->num_calls; i++) {
+        CallTransition *t = &vpa->calls[i];
+        if ((unsigned char)t->symbol == c && bitsTest(&range, t->from_state)) {
+            bitsSet(&to->entries, t->to_state);
+            bitsSet(&to->reach[t->to_state], t->to_state);
+        }
+    }
+}
+
+// Return move: join the caller's summary through the call on call_symbol,
+// the finished level and a return on c that pops what the call pushed
+static void vpaReturn(VPA *vpa, const VPASummary *caller, unsigned char call_symbol,
+                      const VPASummary *inner, unsigned char c, VPASummary *to) {
+    clearSummary(to);
+    to->entries = caller->entries;
+    for (int i = 0; i < vpa->num_calls; i++) {
+        CallTransition *call = &vpa->calls[i];
+        if ((unsigned char)call->symbol != call_symbol || !bitsTest(&inner->entries, call->to_state)) {
+            continue;
+        }
+        const StateBits *inside = &inner->reach[call->to_state];
+        for (int k = 0; k < vpa->num_returns; k++) {
+            ReturnTransition *ret = &vpa->returns[k];
+            if ((unsigned char)ret->symbol != c || ret->pop != call->push ||
+                !bitsTest(inside, ret->from_state)) {
+                continue;
+            }
+            for (int p = 0; p < MAX_STATES; p++) {
+                if (bitsTest(&caller->entries, p) && bitsTest(&caller->reach[p], call->from_state)) {
+                    bitsSet(&to->reach[p], ret->to_state);
+                }
+            }
+        }
+    }
+}
+
+static inline uint32_t vpaReturnSlot(int current, int caller, unsigned char call, unsigned char c) {
+    uint64_t key = ((uint64_t)current << 40) ^ ((uint64_t)caller << 16) ^ ((uint64_t)call << 8) ^ c;
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 40) % VPA_RETURN_SLOTS;
+}
+
+// Feed a chunk. Returns false once the input can no longer be accepted:
+// a dead summary, a return with nothing open, or nesting deeper than
+// VPA_MAX_DEPTH (which also sets overflow).
+bool vpaFeed(VPAMatcher *m, const char *input, size_t length) {
+    VPA *vpa = m->vpa;
+    for (size_t i = 0; i < length && m->state != VPA_REJECTED; i++) {
+        unsigned char c = (unsigned char)input[i];
+        SymbolKind kind = vpa->kinds[c];
+        VPASummary next;
+
+        if (kind == SYMBOL_RETURN) {
+            if (m->depth == 0) {
+                m->state = VPA_REJECTED;
+                break;
+            }
+            int caller = m->stack[m->depth - 1];
+            unsigned char call = m->stack_calls[m->depth - 1];
+            VPAReturnSlot *slot = &m->return_slots[vpaReturnSlot(m->state, caller, call, c)];
+            if (slot->current == m->state && slot->caller == caller &&
+                slot->call == call && slot->symbol == c) {
+                m->depth--;
+                m->state = slot->next;
+                continue;
+            }
+            vpaReturn(vpa, &m->summaries[caller], call, &m->summaries[m->state], c, &next);
+            int target = finishSummary(&next) ? vpaIntern(m, &next) : VPA_REJECTED;
+            // Interning may have compacted, so re-read the ids
+            caller = m->stack[m->depth - 1];
+            slot = &m->return_slots[vpaReturnSlot(m->state, caller, call, c)];
+            slot->current = m->state;
+            slot->caller = caller;
+            slot->call = call;
+            slot->symbol = c;
+            slot->next = target;
+            m->depth--;
+            m->state = target;
+            continue;
+        }
+
+        if (kind == SYMBOL_CALL && m->depth == VPA_MAX_DEPTH) {
+            m->overflow = true;
+            m->state = VPA_REJECTED;
+            break;
+        }
+        int target = m->next[m->state * 256 + c];
+        if (target == LAZY_UNKNOWN) {
+            if (kind == SYMBOL_CALL) {
+                vpaCall(vpa, &m->summaries[m->state], c, &next);
+            } else {
+                vpaInternal(vpa, &m->summaries[m->state], c, &next);
+            }
+            target = finishSummary(&next) ? vpaIntern(m, &next) : VPA_REJECTED;
+            m->next[m->state * 256 + c] = target;
+        }
+        if (kind == SYMBOL_CALL) {
+            m->stack[m->depth] = m->state;
+            m->stack_calls[m->depth++] = c;
+        }
+        m->state = target;
+    }
+    return m->state != VPA_REJECTED;
+}
+
+// True when the input so far is well nested and can end here
+bool vpaAccepting(VPAMatcher *m) {
+    if (m->state == VPA_REJECTED || m->depth != 0) {
+        return false;
+    }
+    VPASummary *summary = &m->summaries[m->state];
+    for (int p = 0; p < MAX_STATES; p++) {
+        if (!bitsTest(&summary->entries, p)) {
+            continue;
+        }
+        for (int i = 0; i < m->vpa->base.num_states; i++) {
+            int q = m->vpa->base.states[i];
+            if (m->vpa->base.is_accepting[q] && bitsTest(&summary->reach[p], q)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// One-shot check; reuse a VPAMatcher to keep its cache across inputs
+bool vpaAccepts(VPA *vpa, const char *input) {
+    VPAMatcher *m = vpaMatcherCreate(vpa);
+    if (m == NULL) {
+        return false;
+    }
+    bool accepted = vpaFeed(m, input, strlen(input)) && vpaAccepting(m);
+    freeVPAMatcher(m);
+    return accepted;
+}
+
+void freeVPAMatcher(VPAMatcher *m) {
+    if (m == NULL) {
+        return;
+    }
+    free(m->summaries);
+    free(m->next);
+    free(m->return_slots);
+    free(m);
+}
+
+// Line records over a byte stream, carried across buffer boundaries by a
+// StreamMatcher
+typedef struct {
+    StreamMatcher matcher;
+    CompiledDFA *dfa;
+    bool open;
+    uint64_t records;
+    uint64_t matches;
+} RecordScanner;
+
+static void recordScanInit(RecordScanner *scanner, CompiledDFA *dfa) {
+    scanner->dfa = dfa;
+    scanner->open = false;
+    scanner->records = 0;
+    scanner->matches = 0;
+    streamInit(&scanner->matcher, NULL, dfa);
+}
+
+static void recordScanFeed(RecordScanner *scanner, const char *data, size_t length) {
+    while (length > 0) {
+        const char *newline = memchr(data, '\n', length);
+        size_t segment = newline != NULL ? (size_t)(newline - data) : length;
+        streamFeed(&scanner->matcher, data, segment);
+        scanner->open = true;
+        if (newline == NULL) {
+            return;
+        }
+        scanner->records++;
+        scanner->matches += streamAccepting(&scanner->matcher);
+        streamInit(&scanner->matcher, NULL, scanner->dfa);
+        scanner->open = false;
+        data += segment + 1;
+        length -= segment + 1;
+    }
+}
+
+// Count a last line that has no trailing newline
+static void recordScanFinish(RecordScanner *scanner) {
+    if (scanner->open) {
+        scanner->records++;
+        scanner->matches += streamAccepting(&scanner->matcher);
+        scanner->open = false;
+    }
+}
+
+#ifdef FSA_HAVE_IO_URING
+// Submission and completion rings of one io_uring instance, mapped
+// directly from the kernel (no liburing)
+typedef struct {
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+    bool fixed;
+} IngestRing;
+
+static bool ringSetup(IngestRing *ring, unsigned entries, struct iovec *buffers) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cq_map_size > ring->sq_map_size) {
+        ring->sq_map_size = ring->cq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single ? ring->sq_map
+                          : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_size);
+        if (!single && ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_size);
+        if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+        close(ring->fd);
+        return false;
+    }
+    if (single) {
+        ring->cq_map_size = 0;
+    }
+
+    char *sq = (char *)ring->sq_map;
+    char *cq = (char *)ring->cq_map;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Registered buffers save the kernel pinning pages on every read
+    ring->fixed = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS,
+                          buffers, entries) == 0;
+    return true;
+}
+
+static void ringClose(IngestRing *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map_size > 0) {
+        munmap(ring->cq_map, ring->cq_map_size);
+    }
+    munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+}
+
+// Queue a read of one whole buffer; buffers[buffer_index] describes it.
+// Nothing reaches the kernel until ringSubmit.
+static void ringQueueRead(IngestRing *ring, int fd, struct iovec *buffers, int buffer_index,
+                          uint64_t offset, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = ring->fixed ? IORING_OP_READ_FIXED : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    if (ring->fixed) {
+        sqe->addr = (uint64_t)(uintptr_t)buffers[buffer_index].iov_base;
+        sqe->len = (unsigned)buffers[buffer_index].iov_len;
+        sqe->buf_index = (uint16_t)buffer_index;
+    } else {
+        sqe->addr = (uint64_t)(uintptr_t)&buffers[buffer_index];
+        sqe->len = 1;
+    }
+    ring->sq_array[index] = index;
+    atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail + 1, memory_order_release);
+}
+
+// Hand the last count queued reads to the kernel with one io_uring_enter.
+// Returns how many it took; the rest are taken back off the queue.
+static unsigned ringSubmit(IngestRing *ring, unsigned count) {
+    unsigned sent = 0;
+    while (sent < count) {
+        int n = (int)syscall(__NR_io_uring_enter, ring->fd, count - sent, 0, 0, NULL, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        sent += (unsigned)n;
+    }
+    if (sent < count) {
+        unsigned tail = *ring->sq_tail;
+        atomic_store_explicit((_Atomic unsigned *)ring->sq_tail, tail - (count - sent), memory_order_release);
+    }
+    return sent;
+}
+
+// Take one completion if there is one, without entering the kernel
+static bool ringPeek(IngestRing *ring, uint64_t *user_data, int *result) {
+    unsigned head = *ring->cq_head;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring->cq_tail, memory_order_acquire);
+    if (head == tail) {
+        return false;
+    }
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+    atomic_store_explicit((_Atomic unsigned *)ring->cq_head, head + 1, memory_order_release);
+    return true;
+}
+
+// Wait for one completion. Fails if io_uring_enter does.
+static bool ringReap(IngestRing *ring, uint64_t *user_data, int *result) {
+    while (!ringPeek(ring, user_data, result)) {
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+// One read in the ingest ring: which file and where, and once complete
+// how many bytes arrived (or -errno)
+typedef struct {
+    int file;
+    uint64_t offset;
+    size_t length;
+    long result;
+    bool done;
+} IngestSlot;
+
+typedef struct {
+    CompiledDFA *dfa;
+    const char **paths;
+    IngestResult *results;
+    const IngestOptions *options;
+    size_t chunk_size;
+    int first;
+    int count;
+    int stride;
+} IngestJob;
+
+// Read a slot's chunk with pread. Only whole aligned blocks are read, so
+// this also works on O_DIRECT descriptors.
+static void ingestReadSync(IngestSlot *slot, int fd, char *buffer, size_t chunk, size_t have) {
+    ssize_t n = 1;
+    while (have < slot->length && n > 0) {
+        size_t from = have - have % INGEST_ALIGN;
+        n = pread(fd, buffer + from, chunk - from, (off_t)(slot->offset + from));
+        if (n > 0 && from + (size_t)n <= have) {
+            break;
+        }
+        if (n > 0) {
+            have = from + (size_t)n;
+        }
+    }
+    slot->result = n < 0 ? -errno : (long)have;
+    slot->done = true;
+}
+
+// Worker: owns every stride-th file and a ring of queue_depth buffers.
+// Reads are issued in file order up to queue_depth ahead, and buffers are
+// matched strictly in issue order, so each file's records are scanned in
+// sequence while later reads (including the next file's) are in flight.
+static void *runIngest(void *arg) {
+    IngestJob *job = (IngestJob *)arg;
+    int depth = job->options->queue_depth > 0 ? job->options->queue_depth : 1;
+    size_t chunk = job->chunk_size;
+
+    char *arena = NULL;
+    IngestSlot *slots = (IngestSlot *)calloc(depth, sizeof(IngestSlot));
+    int *fds = (int *)malloc(sizeof(int) * (job->count > 0 ? job->count : 1));
+    uint64_t *sizes = (uint64_t *)calloc(job->count > 0 ? job->count : 1, sizeof(uint64_t));
+    RecordScanner scanner;
+    if (posix_memalign((void **)&arena, INGEST_ALIGN, chunk * depth) != 0) {
+        arena = NULL;
+    }
+    if (arena == NULL || slots == NULL || fds == NULL || sizes == NULL) {
+        for (int k = 0; k < job->count; k++) {
+            job->results[job->first + k * job->stride].error = ENOMEM;
+        }
+        free(arena);
+        free(slots);
+        free(fds);
+        free(sizes);
+        return NULL;
+    }
+
+    bool use_ring = false;
+#ifdef FSA_HAVE_IO_URING
+    IngestRing ring = {0};
+    bool ring_open = false;
+    struct iovec *buffers = (struct iovec *)malloc(sizeof(struct iovec) * depth);
+    if (!job->options->synchronous && buffers != NULL) {
+        for (int i = 0; i < depth; i++) {
+            buffers[i].iov_base = arena + (size_t)i * chunk;
+            buffers[i].iov_len = chunk;
+        }
+        use_ring = ring_open = ringSetup(&ring, (unsigned)depth, buffers);
+    }
+#endif
+
+    // Open everything up front so the submit loop never blocks on open
+    for (int k = 0; k < job->count; k++) {
+        int file = job->first + k * job->stride;
+        IngestResult *result = &job->results[file];
+        result->path = job->paths[file];
+        int flags = O_RDONLY;
+#ifdef O_DIRECT
+        if (job->options->direct) {
+            flags |= O_DIRECT;
+        }
+#endif
+        fds[k] = open(job->paths[file], flags);
+        if (fds[k] < 0 && flags != O_RDONLY && errno == EINVAL) {
+            fds[k] = open(job->paths[file], O_RDONLY);
+        }
+        struct stat st;
+        if (fds[k] < 0 || fstat(fds[k], &st) != 0) {
+            result->error = errno;
+        } else {
+            sizes[k] = (uint64_t)st.st_size;
+        }
+    }
+
+    int submit_file = 0;
+    uint64_t submit_offset = 0;
+    uint64_t submitted = 0, consumed = 0;
+    int current_file = -1;
+
+    for (;;) {
+        // Keep the ring full, entering the kernel once per refill
+        unsigned queued = 0;
+        while (submitted - consumed < (uint64_t)depth && submit_file < job->count) {
+            if (fds[submit_file] < 0 || submit_offset >= sizes[submit_file]) {
+                submit_file++;
+                submit_offset = 0;
+                continue;
+            }
+            int index = (int)(submitted % depth);
+            IngestSlot *slot = &slots[index];
+            char *buffer = arena + (size_t)index * chunk;
+            slot->file = submit_file;
+            slot->offset = submit_offset;
+            slot->length = sizes[submit_file] - submit_offset < chunk
+                               ? (size_t)(sizes[submit_file] - submit_offset) : chunk;
+            slot->done = false;
+#ifdef FSA_HAVE_IO_URING
+            if (use_ring) {
+                // O_DIRECT wants whole blocks; the tail read just comes up short
+                ringQueueRead(&ring, fds[submit_file], buffers, index, submit_offset, submitted);
+                queued++;
+            }
+#endif
+            if (!use_ring) {
+                ingestReadSync(slot, fds[submit_file], buffer, chunk, 0);
+            }
+            submitted++;
+            submit_offset += chunk;
+        }
+#ifdef FSA_HAVE_IO_URING
+        if (queued > 0) {
+            unsigned sent = ringSubmit(&ring, queued);
+            // Reads the kernel did not take are done here instead
+            for (uint64_t s = submitted - (queued - sent); s < submitted; s++) {
+                int index = (int)(s % depth);
+                ingestReadSync(&slots[index], fds[slots[index].file], arena + (size_t)index * chunk, chunk, 0);
+            }
+        }
+#endif
+        if (consumed == submitted) {
+            break;
+        }
+
+        // Match the oldest read once it has completed
+        int index = (int)(consumed % depth);
+        IngestSlot *slot = &slots[index];
+#ifdef FSA_HAVE_IO_URING
+        while (!slot->done) {
+            uint64_t user_data;
+            int res;
+            bool reaped = use_ring && ringReap(&ring, &user_data, &res);
+            if (!reaped) {
+                // The ring failed: submit no more through it, but the kernel
+                // may still write the buffers of reads in flight, so poll
+                // for their completions before any slot is reused
+                use_ring = false;
+                reaped = ringPeek(&ring, &user_data, &res);
+            }
+            if (reaped) {
+                slots[user_data % depth].result = res;
+                slots[user_data % depth].done = true;
+            } else {
+                struct timespec pause = {0, 1000000};
+                nanosleep(&pause, NULL);
+            }
+        }
+#endif
+        char *buffer = arena + (size_t)index * chunk;
+        int k = slot->file;
+        IngestResult *result = &job->results[job->first + k * job->stride];
+
+        // A short read in the middle of a file is finished synchronously
+        if (slot->result >= 0 && (size_t)slot->result < slot->length) {
+            ingestReadSync(slot, fds[k], buffer, chunk, (size_t)slot->result);
+        }
+
+        if (k != current_file) {
+            recordScanInit(&scanner, job->dfa);
+            current_file = k;
+        }
+        if (slot->result < 0) {
+            if (result->error == 0) {
+                result->error = (int)-slot->result;
+            }
+        } else if (result->error == 0) {
+            size_t n = (size_t)slot->result < slot->length ? (size_t)slot->result : slot->length;
+            recordScanFeed(&scanner, buffer, n);
+            result->bytes += n;
+        }
+        consumed++;
+
+        // Last chunk of the file: settle its counts
+        if (slot->offset + chunk >= sizes[k]) {
+            recordScanFinish(&scanner);
+            result->records = scanner.records;
+            result->matches = scanner.matches;
+            current_file = -1;
+        }
+    }
+
+#ifdef FSA_HAVE_IO_URING
+    // Every read has been consumed, so none is still in flight
+    if (ring_open) {
+        ringClose(&ring);
+    }
+    free(buffers);
+#endif
+    for (int k = 0; k < job->count; k++) {
+        if (fds[k] >= 0) {
+            close(fds[k]);
+        }
+    }
+    free(arena);
+    free(slots);
+    free(fds);
+    free(sizes);
+    return NULL;
+}
+
+// Count matching lines in each file. Every thread keeps queue_depth
+// fixed-size reads in flight through io_uring (falling back to pread when
+// io_uring is unavailable) and matches each buffer as it completes, so
+// I/O overlaps matching. Returns 0, or -1 if the threads could not be
+// started; per-file failures are reported in results[i].error.
+int ingestFiles(CompiledDFA *dfa, const char **paths, int count, const IngestOptions *options, IngestResult *results) {
+    int threads = options->threads > 0 ? options->threads : 1;
+    if (threads > count) {
+        threads = count > 0 ? count : 1;
+    }
+    size_t chunk = options->chunk_size > 0 ? options->chunk_size : 256 * 1024;
+    chunk = (chunk + INGEST_ALIGN - 1) / INGEST_ALIGN * INGEST_ALIGN;
+
+    memset(results, 0, sizeof(IngestResult) * count);
+    pthread_t *handles = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    IngestJob *jobs = (IngestJob *)malloc(sizeof(IngestJob) * threads);
+    if (handles == NULL || jobs == NULL) {
+        free(handles);
+        free(jobs);
+        return -1;
+    }
+
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        jobs[t].dfa = dfa;
+        jobs[t].paths = paths;
+        jobs[t].results = results;
+        jobs[t].options = options;
+        jobs[t].chunk_size = chunk;
+        jobs[t].first = t;
+        jobs[t].stride = threads;
+        jobs[t].count = count > t ? (count - t + threads - 1) / threads : 0;
+        if (pthread_create(&handles[t], NULL, runIngest, &jobs[t]) != 0) {
+            break;
+        }
+        started++;
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(handles[t], NULL);
+    }
+    free(handles);
+    free(jobs);
+    return started == threads ? 0 : -1;
+}
+
+static inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void waiterInit(RingWaiter *waiter, WaitPolicy policy) {
+    waiter->policy = policy;
+    atomic_init(&waiter->sleepers, 0);
+    pthread_mutex_init(&waiter->lock, NULL);
+    pthread_cond_init(&waiter->cond, NULL);
+}
+
+static void waiterDestroy(RingWaiter *waiter) {
+    pthread_mutex_destroy(&waiter->lock);
+    pthread_cond_destroy(&waiter->cond);
+}
+
+// Wait until ready(ring) holds. A blocking waiter registers as a sleeper
+// before its final check under the lock; waiterNotify publishes before
+// reading the sleeper count, so one of the two always sees the other.
+static void waiterWait(RingWaiter *waiter, bool (*ready)(BlockRing *), BlockRing *ring) {
+    for (unsigned spins = 0; !ready(ring); spins++) {
+        if (spins < RING_SPIN_LIMIT) {
+            cpuRelax();
+            continue;
+        }
+        if (waiter->policy == WAIT_SPIN) {
+            // Give the core away in case the other side shares it
+            sched_yield();
+            continue;
+        }
+        atomic_fetch_add(&waiter->sleepers, 1);
+        pthread_mutex_lock(&waiter->lock);
+        while (!ready(ring)) {
+            pthread_cond_wait(&waiter->cond, &waiter->lock);
+        }
+        pthread_mutex_unlock(&waiter->lock);
+        atomic_fetch_sub(&waiter->sleepers, 1);
+        return;
+    }
+}
+
+static void waiterNotify(RingWaiter *waiter) {
+    if (waiter->policy != WAIT_BLOCK) {
+        return;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&waiter->sleepers) > 0) {
+        pthread_mutex_lock(&waiter->lock);
+        pthread_cond_broadcast(&waiter->cond);
+        pthread_mutex_unlock(&waiter->lock);
+    }
+}
+
+// Capacity is rounded up to a power of two
+BlockRing* blockRingCreate(RingKind kind, size_t capacity, WaitPolicy policy) {
+    size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+    BlockRing *ring = NULL;
+    if (posix_memalign((void **)&ring, 64, sizeof(BlockRing)) != 0) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(BlockRing));
+    ring->kind = kind;
+    ring->mask = size - 1;
+    ring->slots = (Block *)malloc(sizeof(Block) * size);
+    if (kind == RING_MPMC) {
+        ring->sequences = (atomic_size_t *)malloc(sizeof(atomic_size_t) * size);
+    }
+    if (ring->slots == NULL || (kind == RING_MPMC && ring->sequences == NULL)) {
+        free(ring->slots);
+        free(ring->sequences);
+        free(ring);
+        return NULL;
+    }
+    for (size_t i = 0; kind == RING_MPMC && i < size; i++) {
+        atomic_init(&ring->sequences[i], i);
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, false);
+    waiterInit(&ring->not_empty, policy);
+    waiterInit(&ring->not_full, policy);
+    return ring;
+}
+
+bool blockRingTryPush(BlockRing *ring, const Block *block) {
+    if (ring->kind == RING_SPSC) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (tail - ring->cached_head > ring->mask) {
+            ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            if (tail - ring->cached_head > ring->mask) {
+                return false;
+            }
+        }
+        ring->slots[tail & ring->mask] = *block;
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    } else {
+        size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (;;) {
+            size_t sequence = atomic_load_explicit(&ring->sequences[pos & ring->mask], memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                          memory_order_relaxed, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            }
+        }
+        ring->slots[pos & ring->mask] = *block;
+        atomic_store_explicit(&ring->sequences[pos & ring->mask], pos + 1, memory_order_release);
+    }
+    waiterNotify(&ring->not_empty);
+    return true;
+}
+
+bool blockRingTryPop(BlockRing *ring, Block *block) {
+    if (ring->kind == RING_SPSC) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        if (head == ring->cached_tail) {
+            ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            if (head == ring->cached_tail) {
+                return false;
+            }
+        }
+        *block = ring->slots[head & ring->mask];
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    } else {
+        size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        for (;;) {
+            size_t sequence = atomic_load_explicit(&ring->sequences[pos & ring->mask], memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                          memory_order_relaxed, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            }
+        }
+        *block = ring->slots[pos & ring->mask];
+        atomic_store_explicit(&ring->sequences[pos & ring->mask], pos + ring->mask + 1, memory_order_release);
+    }
+    waiterNotify(&ring->not_full);
+    return true;
+}
+
+static bool ringHasRoom(BlockRing *ring) {
+    return atomic_load(&ring->tail) - atomic_load(&ring->head) <= ring->mask || atomic_load(&ring->closed);
+}
+
+static bool ringHasData(BlockRing *ring) {
+    return atomic_load(&ring->tail) != atomic_load(&ring->head) || atomic_load(&ring->closed);
+}
+
+// Push, waiting while the ring is full. Fails once the ring is closed.
+bool blockRingPush(BlockRing *ring, const Block *block) {
+    for (;;) {
+        if (atomic_load(&ring->closed)) {
+            return false;
+        }
+        if (blockRingTryPush(ring, block)) {
+            return true;
+        }
+        waiterWait(&ring->not_full, ringHasRoom, ring);
+    }
+}
+
+// Pop, waiting while the ring is empty. Fails once the ring is closed
+// and drained.
+bool blockRingPop(BlockRing *ring, Block *block) {
+    for (;;) {
+        if (blockRingTryPop(ring, block)) {
+            return true;
+        }
+        if (atomic_load(&ring->closed)) {
+            // A push may have landed just before the close
+            return blockRingTryPop(ring, block);
+        }
+        waiterWait(&ring->not_empty, ringHasData, ring);
+    }
+}
+
+// No more pushes; wakes every waiter
+void blockRingClose(BlockRing *ring) {
+    atomic_store(&ring->closed, true);
+    waiterNotify(&ring->not_empty);
+    waiterNotify(&ring->not_full);
+}
+
+void freeBlockRing(BlockRing *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    waiterDestroy(&ring->not_empty);
+    waiterDestroy(&ring->not_full);
+    free(ring->slots);
+    free(ring->sequences);
+    free(ring);
+}
+
+Pipeline* pipelineCreate(size_t ring_capacity, WaitPolicy policy) {
+    Pipeline *pipeline = (Pipeline *)calloc(1, sizeof(Pipeline));
+    if (pipeline != NULL) {
+        pipeline->ring_capacity = ring_capacity;
+        pipeline->policy = policy;
+    }
+    return pipeline;
+}
+
+// Append a stage run by the given number of threads. Returns its index,
+// or -1 if the pipeline is full or already started.
+int pipelineAddStage(Pipeline *pipeline, StageFunction function, void *context, int threads) {
+    if (pipeline->started || pipeline->num_stages == MAX_PIPELINE_STAGES) {
+        return -1;
+    }
+    PipelineStage *stage = &pipeline->stages[pipeline->num_stages];
+    stage->function = function;
+    stage->context = context;
+    stage->threads = threads > 0 ? threads : 1;
+    atomic_init(&stage->running, 0);
+    atomic_init(&stage->items, 0);
+    atomic_init(&stage->bytes, 0);
+    atomic_init(&stage->busy_ns, 0);
+    return pipeline->num_stages++;
+}
+
+typedef struct {
+    Pipeline *pipeline;
+    int stage;
+} StageJob;
+
+static void *runStage(void *arg) {
+    StageJob *job = (StageJob *)arg;
+    Pipeline *pipeline = job->pipeline;
+    PipelineStage *stage = &pipeline->stages[job->stage];
+    BlockRing *in = pipeline->rings[job->stage];
+    BlockRing *out = pipeline->rings[job->stage + 1];
+    free(job);
+
+    Block block;
+    while (blockRingPop(in, &block)) {
+        uint64_t start = monotonicNanos();
+        size_t length = block.length;
+        bool forward = stage->function(stage->context, &block);
+        atomic_fetch_add_explicit(&stage->busy_ns, monotonicNanos() - start, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stage->items, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&stage->bytes, length, memory_order_relaxed);
+        if (forward && !blockRingPush(out, &block)) {
+            break;
+        }
+    }
+    // The last thread out closes the next ring
+    if (atomic_fetch_sub(&stage->running, 1) == 1) {
+        blockRingClose(out);
+    }
+    return NULL;
+}
+
+// Create the rings and start every stage's threads. The caller is the
+// single source (pipelinePush) and single sink (pipelinePop). Returns 0,
+// or -1 if a stage could not start a single thread, in which case the
+// pipeline can only be freed.
+int pipelineStart(Pipeline *pipeline) {
+    if (pipeline->started || pipeline->num_stages == 0) {
+        return -1;
+    }
+    int total = 0;
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        total += pipeline->stages[i].threads;
+    }
+    pipeline->threads = (pthread_t *)malloc(sizeof(pthread_t) * total);
+    if (pipeline->threads == NULL) {
+        return -1;
+    }
+    for (int i = 0; i <= pipeline->num_stages; i++) {
+        int producers = i == 0 ? 1 : pipeline->stages[i - 1].threads;
+        int consumers = i == pipeline->num_stages ? 1 : pipeline->stages[i].threads;
+        RingKind kind = producers == 1 && consumers == 1 ? RING_SPSC : RING_MPMC;
+        pipeline->rings[i] = blockRingCreate(kind, pipeline->ring_capacity, pipeline->policy);
+        if (pipeline->rings[i] == NULL) {
+            return -1;
+        }
+    }
+    pipeline->started = true;
+
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        atomic_store(&pipeline->stages[i].running, pipeline->stages[i].threads);
+    }
+    bool stalled = false;
+    for (int i = 0; i < pipeline->num_stages; i++) {
+        PipelineStage *stage = &pipeline->stages[i];
+        int started = 0;
+        for (int t = 0; t < stage->threads; t++) {
+            StageJob *job = (StageJob *)malloc(sizeof(StageJob));
+            if (job != NULL) {
+                job->pipeline = pipeline;
+                job->stage = i;
+            }
+            if (job == NULL || pthread_create(&pipeline->threads[pipeline->num_threads], NULL, runStage, job) != 0) {
+                free(job);
+                // Account for the missing thread so the stage still closes
+                if (atomic_fetch_sub(&stage->running, 1) == 1) {
+                    blockRingClose(pipeline->rings[i + 1]);
+                }
+                continue;
+            }
+            pipeline->num_threads++;
+            started++;
+        }
+        // Nothing would ever drain this stage's input ring
+        stalled = stalled || started == 0;
+    }
+    if (stalled) {
+        for (int i = 0; i <= pipeline->num_stages; i++) {
+            blockRingClose(pipeline->rings[i]);
+        }
+        for (int t = 0; t < pipeline->num_threads; t++) {
+            pthread_join(pipeline->threads[t], NULL);
+        }
+        pipeline->num_threads = 0;
+        pipeline->started = false;
+        return -1;
+    }
+    return 0;
+}
+
+// Feed a block in, waiting while the first stage is backed up
+bool pipelinePush(Pipeline *pipeline, const Block *block) {
+    return pipeline->started && blockRingPush(pipeline->rings[0], block);
+}
+
+// No more input; stages drain and shut down in order
+void pipelineFinish(Pipeline *pipeline) {
+    if (pipeline->started) {
+        blockRingClose(pipeline->rings[0]);
+    }
+}
+
+// Take a block from the end of the pipeline. Returns false once the
+// pipeline has finished and drained.
+bool pipelinePop(Pipeline *pipeline, Block *block) {
+    return pipeline->started && blockRingPop(pipeline->rings[pipeline->num_stages], block);
+}
+
+// Throughput counters of a stage: blocks and bytes processed and the time
+// spent inside its function, summed over its threads
+void pipelineStageStats(Pipeline *pipeline, int stage, uint64_t *items, uint64_t *bytes, uint64_t *busy_ns) {
+    *items = atomic_load(&pipeline->stages[stage].items);
+    *bytes = atomic_load(&pipeline->stages[stage].bytes);
+    *busy_ns = atomic_load(&pipeline->stages[stage].busy_ns);
+}
+
+// Stop the pipeline and join its threads. Blocks still inside are
+// dropped, so finish and drain it first to keep them.
+void freePipeline(Pipeline *pipeline) {
+    if (pipeline == NULL) {
+        return;
+    }
+    if (pipeline->started) {
+        for (int i = 0; i <= pipeline->num_stages; i++) {
+            if (pipeline->rings[i] != NULL) {
+                blockRingClose(pipeline->rings[i]);
+            }
+        }
+        for (int t = 0; t < pipeline->num_threads; t++) {
+            pthread_join(pipeline->threads[t], NULL);
+        }
+    }
+    for (int i = 0; i <= pipeline->num_stages; i++) {
+        freeBlockRing(pipeline->rings[i]);
+    }
+    free(pipeline->threads);
+    free(pipeline);
+}
+
+// One decompress-and-match pipeline. The decompressor fills blocks taken
+// from free_blocks and pushes them to filled; the matcher hands them back
+// once scanned, so the pipeline runs in BLOCK_QUEUE_DEPTH fixed buffers.
+typedef struct {
+    CompiledDFA *dfa;
+    const char **paths;
+    IngestResult *results;
+    int first;
+    int count;
+    int stride;
+    BlockRing *filled;
+    BlockRing *free_blocks;
+    Block current;
+} DecompressJob;
+
+// Hand the current block to the matcher and start a fresh one
+static void flushBlock(DecompressJob *job, int file, bool end, int error) {
+    job->current.file = file;
+    job->current.end = end;
+    job->current.error = error;
+    blockRingPush(job->filled, &job->current);
+    blockRingPop(job->free_blocks, &job->current);
+    job->current.length = 0;
+}
+
+#define DECOMPRESS_INPUT_SIZE (64 * 1024)
+
+// Decompress (or copy) fd into blocks. in holds the have bytes already
+// read to sniff the format. Returns 0 or an errno value.
+static int decompressStream(DecompressJob *job, int file, int fd, unsigned char *in, size_t have) {
+    bool gzip = have >= 2 && in[0] == 0x1f && in[1] == 0x8b;
+    bool zstd = have >= 4 && in[0] == 0x28 && in[1] == 0xb5 && in[2] == 0x2f && in[3] == 0xfd;
+
+    if (gzip) {
+#ifdef FSA_WITH_ZLIB
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        // 15 + 32: any window size, gzip or zlib header
+        if (inflateInit2(&z, 15 + 32) != Z_OK) {
+            return ENOMEM;
+        }
+        z.next_in = in;
+        z.avail_in = (uInt)have;
+        bool finished = false;
+        bool full = false;
+        int error = 0;
+        for (;;) {
+            if (z.avail_in == 0 && !full) {
+                ssize_t n = read(fd, in, DECOMPRESS_INPUT_SIZE);
+                if (n < 0) {
+                    error = errno;
+                    break;
+                }
+                if (n == 0) {
+                    error = finished ? 0 : EIO;
+                    break;
+                }
+                z.next_in = in;
+                z.avail_in = (uInt)n;
+            }
+            // Concatenated gzip members decode as one stream
+            if (finished) {
+                inflateReset(&z);
+                finished = false;
+            }
+            z.next_out = (Bytef *)job->current.data + job->current.length;
+            z.avail_out = (uInt)(DECOMPRESS_BLOCK_SIZE - job->current.length);
+            int rc = inflate(&z, Z_NO_FLUSH);
+            job->current.length = DECOMPRESS_BLOCK_SIZE - z.avail_out;
+            // A full block may leave output pending in the stream, so
+            // inflate again before reading more input; an ended member
+            // has nothing left to give
+            full = job->current.length == DECOMPRESS_BLOCK_SIZE && rc != Z_STREAM_END;
+            if (job->current.length == DECOMPRESS_BLOCK_SIZE) {
+                flushBlock(job, file, false, 0);
+            }
+            if (rc == Z_STREAM_END) {
+                finished = true;
+            } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+                error = EIO;
+                break;
+            }
+        }
+        inflateEnd(&z);
+        return error;
+#else
+        return ENOTSUP;
+#endif
+    }
+
+    if (zstd) {
+#ifdef FSA_WITH_ZSTD
+        ZSTD_DStream *stream = ZSTD_createDStream();
+        if (stream == NULL) {
+            return ENOMEM;
+        }
+        ZSTD_initDStream(stream);
+        ZSTD_inBuffer input = {in, have, 0};
+        size_t hint = 1;
+        bool full = false;
+        int error = 0;
+        for (;;) {
+            if (input.pos == input.size && !full) {
+                ssize_t n = read(fd, in, DECOMPRESS_INPUT_SIZE);
+                if (n < 0) {
+                    error = errno;
+                    break;
+                }
+                if (n == 0) {
+                    // hint is 0 exactly when the last frame was complete
+                    error = hint == 0 ? 0 : EIO;
+                    break;
+                }
+                input.size = (size_t)n;
+                input.pos = 0;
+            }
+            ZSTD_outBuffer output = {job->current.data, DECOMPRESS_BLOCK_SIZE, job->current.length};
+            hint = ZSTD_decompressStream(stream, &output, &input);
+            job->current.length = output.pos;
+            // Decoded data can outlast the input: keep draining it into
+            // fresh blocks until one is left partly empty or the frame
+            // is done (hint 0)
+            full = job->current.length == DECOMPRESS_BLOCK_SIZE && hint != 0;
+            if (job->current.length == DECOMPRESS_BLOCK_SIZE) {
+                flushBlock(job, file, false, 0);
+            }
+            if (ZSTD_isError(hint)) {
+                error = EIO;
+                break;
+            }
+        }
+        ZSTD_freeDStream(stream);
+        return error;
+#else
+        return ENOTSUP;
+#endif
+    }
+
+    // Uncompressed: copy through
+    for (;;) {
+        while (have > 0) {
+            size_t room = DECOMPRESS_BLOCK_SIZE - job->current.length;
+            size_t n = have < room ? have : room;
+            memcpy(job->current.data + job->current.length, in, n);
+            job->current.length += n;
+            memmove(in, in + n, have - n);
+            have -= n;
+            if (job->current.length == DECOMPRESS_BLOCK_SIZE) {
+                flushBlock(job, file, false, 0);
+            }
+        }
+        ssize_t n = read(fd, in, DECOMPRESS_INPUT_SIZE);
+        if (n < 0) {
+            return errno;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        have = (size_t)n;
+    }
+}
+
+static void *runDecompressor(void *arg) {
+    DecompressJob *job = (DecompressJob *)arg;
+    unsigned char *in = (unsigned char *)malloc(DECOMPRESS_INPUT_SIZE);
+    blockRingPop(job->free_blocks, &job->current);
+    job->current.length = 0;
+
+    for (int k = 0; k < job->count; k++) {
+        int error = 0;
+        int fd = in != NULL ? open(job->paths[job->first + k * job->stride], O_RDONLY) : -1;
+        if (in == NULL) {
+            error = ENOMEM;
+        } else if (fd < 0) {
+            error = errno;
+        } else {
+            // Read enough to recognize the format from its magic bytes
+            size_t have = 0;
+            while (have < 4) {
+                ssize_t n = read(fd, in + have, DECOMPRESS_INPUT_SIZE - have);
+                if (n <= 0) {
+                    error = n < 0 ? errno : 0;
+                    break;
+                }
+                have += (size_t)n;
+            }
+            if (error == 0) {
+                error = decompressStream(job, k, fd, in, have);
+            }
+            close(fd);
+        }
+        flushBlock(job, k, true, error);
+    }
+
+    // The spare block stays out: the matcher is the only producer on
+    // free_blocks, and every buffer is freed with the arena
+    free(in);
+    return NULL;
+}
+
+// Matcher side of a pipeline: scan blocks in order as they arrive
+static void *runCompressedScan(void *arg) {
+    DecompressJob *job = (DecompressJob *)arg;
+    pthread_t decompressor;
+    if (pthread_create(&decompressor, NULL, runDecompressor, job) != 0) {
+        for (int k = 0; k < job->count; k++) {
+            job->results[job->first + k * job->stride].error = EAGAIN;
+        }
+        return NULL;
+    }
+
+    RecordScanner scanner;
+    recordScanInit(&scanner, job->dfa);
+    for (int done = 0; done < job->count;) {
+        Block block;
+        blockRingPop(job->filled, &block);
+        IngestResult *result = &job->results[job->first + block.file * job->stride];
+        recordScanFeed(&scanner, block.data, block.length);
+        result->bytes += block.length;
+        if (block.end) {
+            recordScanFinish(&scanner);
+            result->records = scanner.records;
+            result->matches = scanner.matches;
+            result->error = block.error;
+            recordScanInit(&scanner, job->dfa);
+            done++;
+        }
+        blockRingPush(job->free_blocks, &block);
+    }
+    pthread_join(decompressor, NULL);
+    return NULL;
+}
+
+// Count matching lines in plain, gzip or zstd files without writing the
+// decompressed data anywhere. Each of the threads pipelines runs a
+// decompressor thread feeding a matcher through a bounded ring, so
+// decompression and matching overlap. Formats are recognized by their
+// magic bytes; a format not compiled in fails with ENOTSUP in
+// results[i].error. Returns 0, or -1 if the pipelines could not be set up.
+int scanCompressedFiles(CompiledDFA *dfa, const char **paths, int count, int threads, IngestResult *results) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = count > 0 ? count : 1;
+    }
+    memset(results, 0, sizeof(IngestResult) * count);
+    for (int i = 0; i < count; i++) {
+        results[i].path = paths[i];
+    }
+
+    DecompressJob *jobs = (DecompressJob *)calloc(threads, sizeof(DecompressJob));
+    pthread_t *handles = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    char *arena = (char *)malloc((size_t)threads * (BLOCK_QUEUE_DEPTH + 1) * DECOMPRESS_BLOCK_SIZE);
+    if (jobs == NULL || handles == NULL || arena == NULL) {
+        free(jobs);
+        free(handles);
+        free(arena);
+        return -1;
+    }
+
+    int ready = 0;
+    for (int t = 0; t < threads; t++) {
+        DecompressJob *job = &jobs[t];
+        job->dfa = dfa;
+        job->paths = paths;
+        job->results = results;
+        job->first = t;
+        job->stride = threads;
+        job->count = count > t ? (count - t + threads - 1) / threads : 0;
+        job->filled = blockRingCreate(RING_SPSC, BLOCK_QUEUE_DEPTH + 1, WAIT_BLOCK);
+        job->free_blocks = blockRingCreate(RING_SPSC, BLOCK_QUEUE_DEPTH + 1, WAIT_BLOCK);
+        if (job->filled == NULL || job->free_blocks == NULL) {
+            freeBlockRing(job->filled);
+            freeBlockRing(job->free_blocks);
+            break;
+        }
+        for (int b = 0; b <= BLOCK_QUEUE_DEPTH; b++) {
+            Block block = {arena + ((size_t)t * (BLOCK_QUEUE_DEPTH + 1) + b) * DECOMPRESS_BLOCK_SIZE, 0, 0, 0, false};
+            blockRingPush(job->free_blocks, &block);
+        }
+        ready++;
+    }
+
+    int started = 0;
+    if (ready == threads) {
+        for (; started < threads; started++) {
+            if (pthread_create(&handles[started], NULL, runCompressedScan, &jobs[started]) != 0) {
+                break;
+            }
+        }
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(handles[t], NULL);
+    }
+    for (int t = 0; t < ready; t++) {
+        freeBlockRing(jobs[t].filled);
+        freeBlockRing(jobs[t].free_blocks);
+    }
+    free(jobs);
+    free(handles);
+    free(arena);
+    return started == threads ? 0 : -1;
+}
+
+// Matching lines found in one chunk of a file, numbered from the chunk's
+// first line
+typedef struct {
+    uint64_t lines;
+    size_t count;
+    size_t capacity;
+    uint64_t *line_numbers;
+    char **texts;
+    int error;
+} ChunkResult;
+
+// A file to scan, or a directory or entry that failed, which only
+// carries the error
+typedef struct {
+    char *path;
+    uint64_t size;
+    bool directory;
+    int num_chunks;
+    ChunkResult *chunks;
+} ScanFile;
+
+// A directory to list, or chunk `chunk` of a file
+typedef struct {
+    char *directory;
+    ScanFile *file;
+    int chunk;
+} ScanTask;
+
+// Work-stealing deque: the owner pushes and pops at the bottom, thieves
+// take from the top, which holds the oldest and usually largest work
+typedef struct {
+    ScanTask *tasks;
+    size_t top;
+    size_t bottom;
+    size_t capacity;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+typedef struct {
+    CompiledDFA *dfa;
+    ScanOptions options;
+    int num_workers;
+    TaskDeque *deques;
+    atomic_long pending;
+    atomic_ullong submitted;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t work_ready;
+    pthread_mutex_t files_lock;
+    ScanFile **files;
+    size_t num_files;
+    size_t files_capacity;
+} ScanPool;
+
+typedef struct {
+    ScanPool *pool;
+    int id;
+} ScanWorker;
+
+#define SCAN_READ_SIZE (64 * 1024)
+
+static bool dequePush(TaskDeque *deque, const ScanTask *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom == deque->capacity) {
+        // Slide live tasks down before growing
+        size_t live = deque->bottom - deque->top;
+        memmove(deque->tasks, deque->tasks + deque->top, live * sizeof(ScanTask));
+        deque->top = 0;
+        deque->bottom = live;
+        if (live * 2 > deque->capacity) {
+            size_t capacity = deque->capacity * 2;
+            ScanTask *tasks = (ScanTask *)realloc(deque->tasks, capacity * sizeof(ScanTask));
+            if (tasks == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                return false;
+            }
+            deque->tasks = tasks;
+            deque->capacity = capacity;
+        }
+    }
+    deque->tasks[deque->bottom++] = *task;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+static bool dequePop(TaskDeque *deque, ScanTask *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom > deque->top;
+    if (found) {
+        *task = deque->tasks[--deque->bottom];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool dequeSteal(TaskDeque *deque, ScanTask *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->bottom > deque->top;
+    if (found) {
+        *task = deque->tasks[deque->top++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static void scanAddError(ScanPool *pool, char *path, int error, bool directory);
+
+// Queue a task and wake an idle worker for it
+static void scanSubmit(ScanPool *pool, int worker, const ScanTask *task) {
+    atomic_fetch_add(&pool->pending, 1);
+    if (!dequePush(&pool->deques[worker], task)) {
+        atomic_fetch_sub(&pool->pending, 1);
+        if (task->file != NULL) {
+            task->file->chunks[task->chunk].error = ENOMEM;
+        } else {
+            scanAddError(pool, task->directory, ENOMEM, true);
+        }
+        return;
+    }
+    pthread_mutex_lock(&pool->idle_lock);
+    atomic_fetch_add(&pool->submitted, 1);
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+static char *joinPath(const char *directory, const char *name) {
+    size_t a = strlen(directory), b = strlen(name);
+    char *path = (char *)malloc(a + b + 2);
+    if (path != NULL) {
+        memcpy(path, directory, a);
+        path[a] = '/';
+        memcpy(path + a + 1, name, b + 1);
+    }
+    return path;
+}
+
+// Add a file with num_chunks empty results to the pool's list. Takes
+// ownership of path, which is freed on failure.
+static ScanFile *scanRegisterFile(ScanPool *pool, char *path, uint64_t size, int num_chunks) {
+    ScanFile *file = (ScanFile *)calloc(1, sizeof(ScanFile));
+    if (file != NULL) {
+        file->chunks = (ChunkResult *)calloc(num_chunks, sizeof(ChunkResult));
+    }
+    pthread_mutex_lock(&pool->files_lock);
+    if (file != NULL && file->chunks != NULL && pool->num_files == pool->files_capacity) {
+        size_t capacity = pool->files_capacity ? pool->files_capacity * 2 : 64;
+        ScanFile **files = (ScanFile **)realloc(pool->files, capacity * sizeof(ScanFile *));
+        if (files != NULL) {
+            pool->files = files;
+            pool->files_capacity = capacity;
+        }
+    }
+    bool added = file != NULL && file->chunks != NULL && pool->num_files < pool->files_capacity;
+    if (added) {
+        pool->files[pool->num_files++] = file;
+    }
+    pthread_mutex_unlock(&pool->files_lock);
+    if (!added) {
+        if (file != NULL) {
+            free(file->chunks);
+        }
+        free(file);
+        free(path);
+        return NULL;
+    }
+
+    file->path = path;
+    file->size = size;
+    file->num_chunks = num_chunks;
+    return file;
+}
+
+// Record that path could not be read. Takes ownership of path.
+static void scanAddError(ScanPool *pool, char *path, int error, bool directory) {
+    ScanFile *file = path != NULL ? scanRegisterFile(pool, path, 0, 1) : NULL;
+    if (file != NULL) {
+        file->directory = directory;
+        file->chunks[0].error = error;
+    }
+}
+
+// Register a regular file and queue its chunks. Takes ownership of path.
+static void scanAddFile(ScanPool *pool, int worker, char *path, uint64_t size) {
+    size_t chunk = pool->options.chunk_size;
+    int num_chunks = size == 0 ? 1 : (int)((size + chunk - 1) / chunk);
+    ScanFile *file = scanRegisterFile(pool, path, size, num_chunks);
+    if (file == NULL) {
+        return;
+    }
+    for (int k = 0; k < num_chunks; k++) {
+        ScanTask task = {NULL, file, k};
+        scanSubmit(pool, worker, &task);
+    }
+}
+
+// List a directory, queueing its subdirectories and files. Takes
+// ownership of directory.
+static void scanListDirectory(ScanPool *pool, int worker, char *directory) {
+    DIR *dir = opendir(directory);
+    if (dir == NULL) {
+        scanAddError(pool, directory, errno, true);
+        return;
+    }
+    int error = 0;
+    struct dirent *entry;
+    for (;;) {
+        errno = 0;
+        entry = readdir(dir);
+        if (entry == NULL) {
+            error = errno;
+            break;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char *path = joinPath(directory, entry->d_name);
+        if (path == NULL) {
+            error = ENOMEM;
+            continue;
+        }
+        // Symbolic links are not followed
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            scanAddError(pool, path, errno, false);
+        } else if (S_ISDIR(st.st_mode)) {
+            ScanTask task = {path, NULL, 0};
+            scanSubmit(pool, worker, &task);
+        } else if (S_ISREG(st.st_mode)) {
+            scanAddFile(pool, worker, path, (uint64_t)st.st_size);
+        } else {
+            free(path);
+        }
+    }
+    closedir(dir);
+    // Entries were lost: report the directory itself
+    if (error != 0) {
+        scanAddError(pool, directory, error, true);
+    } else {
+        free(directory);
+    }
+}
+
+static bool chunkAddMatch(ChunkResult *result, uint64_t line, const char *text, size_t length, bool keep_text) {
+    if (result->count == result->capacity) {
+        size_t capacity = result->capacity ? result->capacity * 2 : 16;
+        uint64_t *numbers = (uint64_t *)realloc(result->line_numbers, capacity * sizeof(uint64_t));
+        if (numbers == NULL) {
+            return false;
+        }
+        result->line_numbers = numbers;
+        char **texts = (char **)realloc(result->texts, capacity * sizeof(char *));
+        if (texts == NULL) {
+            return false;
+        }
+        result->texts = texts;
+        result->capacity = capacity;
+    }
+    char *copy = NULL;
+    if (keep_text) {
+        copy = (char *)malloc(length + 1);
+        if (copy == NULL) {
+            return false;
+        }
+        if (length > 0) {
+            memcpy(copy, text, length);
+        }
+        copy[length] = '\0';
+    }
+    result->line_numbers[result->count] = line;
+    result->texts[result->count++] = copy;
+    return true;
+}
+
+// Scan the lines that start in chunk k of a file. A chunk after the first
+// skips the partial line it begins in (unless the previous byte is a
+// newline) and reads past its end to finish its last line.
+static void scanChunk(ScanPool *pool, ScanFile *file, int k) {
+    ChunkResult *result = &file->chunks[k];
+    uint64_t start = (uint64_t)k * pool->options.chunk_size;
+    uint64_t end = start + pool->options.chunk_size < file->size ? start + pool->options.chunk_size : file->size;
+    bool keep_text = pool->options.lines;
+
+    int fd = open(file->path, O_RDONLY);
+    char *buffer = (char *)malloc(SCAN_READ_SIZE);
+    char *line = NULL;
+    size_t line_length = 0, line_capacity = 0;
+    if (fd < 0 || buffer == NULL) {
+        result->error = fd < 0 ? errno : ENOMEM;
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(buffer);
+        return;
+    }
+
+    bool skipping = false;
+    if (start > 0) {
+        char previous;
+        skipping = pread(fd, &previous, 1, (off_t)(start - 1)) != 1 || previous != '\n';
+    }
+
+    StreamMatcher matcher;
+    streamInit(&matcher, NULL, pool->dfa);
+    bool open_line = false;
+    uint64_t pos = start;
+    for (;;) {
+        ssize_t n = pread(fd, buffer, SCAN_READ_SIZE, (off_t)pos);
+        if (n < 0) {
+            result->error = errno;
+            break;
+        }
+        if (n == 0) {
+            // A last line without a newline still counts
+            if (open_line) {
+                if (streamAccepting(&matcher) &&
+                    !chunkAddMatch(result, result->lines, line, line_length, keep_text)) {
+                    result->error = ENOMEM;
+                }
+                result->lines++;
+            }
+            break;
+        }
+
+        size_t i = 0;
+        bool done = false;
+        while (i < (size_t)n && !done) {
+            const char *newline = memchr(buffer + i, '\n', (size_t)n - i);
+            size_t segment = newline != NULL ? (size_t)(newline - (buffer + i)) : (size_t)n - i;
+            if (skipping) {
+                if (newline == NULL) {
+                    i = (size_t)n;
+                    break;
+                }
+                skipping = false;
+            } else {
+                streamFeed(&matcher, buffer + i, segment);
+                open_line = true;
+                if (keep_text && segment > 0) {
+                    if (line_length + segment > line_capacity) {
+                        size_t capacity = (line_length + segment) * 2;
+                        char *grown = (char *)realloc(line, capacity);
+                        if (grown == NULL) {
+                            result->error = ENOMEM;
+                            done = true;
+                            break;
+                        }
+                        line = grown;
+                        line_capacity = capacity;
+                    }
+                    memcpy(line + line_length, buffer + i, segment);
+                    line_length += segment;
+                }
+                if (newline == NULL) {
+                    i = (size_t)n;
+                    break;
+                }
+                if (streamAccepting(&matcher) &&
+                    !chunkAddMatch(result, result->lines, line, line_length, keep_text)) {
+                    result->error = ENOMEM;
+                    done = true;
+                }
+                result->lines++;
+                streamInit(&matcher, NULL, pool->dfa);
+                open_line = false;
+                line_length = 0;
+            }
+            i += segment + 1;
+            // The next line starts at pos + i; past end it is the next chunk's
+            done = done || pos + i >= end;
+        }
+        if (done) {
+            break;
+        }
+        pos += (uint64_t)n;
+    }
+
+    close(fd);
+    free(buffer);
+    free(line);
+}
+
+static void *runScanWorker(void *arg) {
+    ScanWorker *worker = (ScanWorker *)arg;
+    ScanPool *pool = worker->pool;
+    int victim = worker->id;
+    while (atomic_load(&pool->pending) > 0) {
+        uint64_t seen = atomic_load(&pool->submitted);
+        ScanTask task;
+        bool found = dequePop(&pool->deques[worker->id], &task);
+        for (int i = 1; !found && i < pool->num_workers; i++) {
+            victim = (victim + 1) % pool->num_workers;
+            if (victim != worker->id) {
+                found = dequeSteal(&pool->deques[victim], &task);
+            }
+        }
+        if (!found) {
+            // Park until a task is queued after the deques were checked,
+            // or the last task finishes
+            pthread_mutex_lock(&pool->idle_lock);
+            while (atomic_load(&pool->submitted) == seen && atomic_load(&pool->pending) > 0) {
+                pthread_cond_wait(&pool->work_ready, &pool->idle_lock);
+            }
+            pthread_mutex_unlock(&pool->idle_lock);
+            continue;
+        }
+        if (task.directory != NULL) {
+            scanListDirectory(pool, worker->id, task.directory);
+        } else {
+            scanChunk(pool, task.file, task.chunk);
+        }
+        if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+            pthread_mutex_lock(&pool->idle_lock);
+            pthread_cond_broadcast(&pool->work_ready);
+            pthread_mutex_unlock(&pool->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+static int compareScanFiles(const void *a, const void *b) {
+    return strcmp((*(ScanFile *const *)a)->path, (*(ScanFile *const *)b)->path);
+}
+
+static bool reportAdd(ScanReport *report, size_t *capacity, const ScanMatch *match) {
+    if (report->count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 64;
+        ScanMatch *matches = (ScanMatch *)realloc(report->matches, grown * sizeof(ScanMatch));
+        if (matches == NULL) {
+            return false;
+        }
+        report->matches = matches;
+        *capacity = grown;
+    }
+    report->matches[report->count++] = *match;
+    return true;
+}
+
+// Find the lines accepted by dfa in every regular file under root (or in
+// root itself if it is a file). Directories are listed and files scanned
+// by a pool of worker threads with work-stealing deques, and large files
+// are split into line-aligned chunks. The report is ordered by path and
+// line number whatever the scheduling. Returns 0, or -1 on failure.
+int scanDirectory(CompiledDFA *dfa, const char *root, const ScanOptions *options, ScanReport *report) {
+    memset(report, 0, sizeof(ScanReport));
+    ScanPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.dfa = dfa;
+    pool.options = *options;
+    if (pool.options.chunk_size == 0) {
+        pool.options.chunk_size = 4 * 1024 * 1024;
+    }
+    pool.num_workers = options->threads > 0 ? options->threads : 1;
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.submitted, 0);
+    pthread_mutex_init(&pool.idle_lock, NULL);
+    pthread_cond_init(&pool.work_ready, NULL);
+    pthread_mutex_init(&pool.files_lock, NULL);
+    pool.deques = (TaskDeque *)calloc(pool.num_workers, sizeof(TaskDeque));
+    ScanWorker *workers = (ScanWorker *)malloc(sizeof(ScanWorker) * pool.num_workers);
+    pthread_t *handles = (pthread_t *)malloc(sizeof(pthread_t) * pool.num_workers);
+    char *root_copy = (char *)malloc(strlen(root) + 1);
+    bool ok = pool.deques != NULL && workers != NULL && handles != NULL && root_copy != NULL;
+    int initialized = 0;
+    for (; ok && initialized < pool.num_workers; initialized++) {
+        TaskDeque *deque = &pool.deques[initialized];
+        deque->capacity = 64;
+        deque->tasks = (ScanTask *)malloc(sizeof(ScanTask) * deque->capacity);
+        pthread_mutex_init(&deque->lock, NULL);
+        ok = deque->tasks != NULL;
+    }
+
+    struct stat st;
+    if (ok && stat(root, &st) != 0) {
+        ok = false;
+    }
+    if (ok) {
+        strcpy(root_copy, root);
+        if (S_ISDIR(st.st_mode)) {
+            ScanTask task = {root_copy, NULL, 0};
+            scanSubmit(&pool, 0, &task);
+        } else {
+            scanAddFile(&pool, 0, root_copy, (uint64_t)st.st_size);
+        }
+        root_copy = NULL;
+
+        int started = 0;
+        for (; started < pool.num_workers; started++) {
+            workers[started].pool = &pool;
+            workers[started].id = started;
+            if (pthread_create(&handles[started], NULL, runScanWorker, &workers[started]) != 0) {
+                break;
+            }
+        }
+        if (started == 0) {
+            // Run the pool on this thread instead
+            workers[0].pool = &pool;
+            workers[0].id = 0;
+            runScanWorker(&workers[0]);
+        }
+        for (int t = 0; t < started; t++) {
+            pthread_join(handles[t], NULL);
+        }
+    }
+
+    // Deterministic merge: files by path, chunks in order, line numbers
+    // rebased by the line counts of the chunks before them
+    qsort(pool.files, pool.num_files, sizeof(ScanFile *), compareScanFiles);
+    size_t capacity = 0;
+    for (size_t f = 0; f < pool.num_files; f++) {
+        ScanFile *file = pool.files[f];
+        int error = 0;
+        uint64_t base = 0, count = 0;
+        for (int k = 0; k < file->num_chunks; k++) {
+            ChunkResult *chunk = &file->chunks[k];
+            if (chunk->error != 0 && error == 0) {
+                error = chunk->error;
+            }
+            for (size_t m = 0; m < chunk->count; m++) {
+                if (options->lines && ok && error == 0) {
+                    ScanMatch match = {strdup(file->path), base + chunk->line_numbers[m] + 1, 1,
+                                       chunk->texts[m], 0};
+                    ok = match.path != NULL && reportAdd(report, &capacity, &match);
+                    if (ok) {
+                        chunk->texts[m] = NULL;
+                    } else {
+                        free(match.path);
+                    }
+                }
+                free(chunk->texts[m]);
+            }
+            count += chunk->count;
+            base += chunk->lines;
+            free(chunk->line_numbers);
+            free(chunk->texts);
+        }
+        if (!file->directory) {
+            report->files++;
+            report->bytes += file->size;
+        }
+        if (ok && (error != 0 || (!options->lines && count > 0))) {
+            ScanMatch match = {strdup(file->path), 0, count, NULL, error};
+            ok = match.path != NULL && reportAdd(report, &capacity, &match);
+            if (!ok) {
+                free(match.path);
+            }
+        }
+        free(file->chunks);
+        free(file->path);
+        free(file);
+    }
+
+    for (int i = 0; i < initialized; i++) {
+        free(pool.deques[i].tasks);
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    pthread_mutex_destroy(&pool.idle_lock);
+    pthread_cond_destroy(&pool.work_ready);
+    pthread_mutex_destroy(&pool.files_lock);
+    free(pool.deques);
+    free(pool.files);
+    free(workers);
+    free(handles);
+    free(root_copy);
+    if (!ok) {
+        freeScanReport(report);
+        return -1;
+    }
+    return 0;
+}
+
+void freeScanReport(ScanReport *report) {
+    for (size_t i = 0; i < report->count; i++) {
+        free(report->matches[i].path);
+        free(report->matches[i].text);
+    }
+    free(report->matches);
+    report->matches = NULL;
+    report->count = 0;
+}
+
+#ifdef __linux__
+static void putU32(unsigned char *buf, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        buf[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint32_t getU32(const unsigned char *buf) {
+    return (uint32_t)buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+// Make room for need more bytes after length
+static bool reserveBytes(char **buffer, size_t *capacity, size_t length, size_t need) {
+    if (length + need <= *capacity) {
+        return true;
+    }
+    size_t grown = *capacity ? *capacity : 4096;
+    while (grown < length + need) {
+        grown *= 2;
+    }
+    char *resized = (char *)realloc(*buffer, grown);
+    if (resized == NULL) {
+        return false;
+    }
+    *buffer = resized;
+    *capacity = grown;
+    return true;
+}
+
+static void closeConnection(MatchServer *server, int index) {
+    ServerConnection *connection = server->connections[index];
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->in);
+    free(connection->out);
+    free(connection);
+    server->connections[index] = server->connections[--server->num_connections];
+}
+
+static void acceptConnections(MatchServer *server) {
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        ServerConnection *connection = (ServerConnection *)calloc(1, sizeof(ServerConnection));
+        if (connection != NULL && server->num_connections == server->connections_capacity) {
+            int capacity = server->connections_capacity ? server->connections_capacity * 2 : 16;
+            ServerConnection **grown = (ServerConnection **)realloc(
+                server->connections, capacity * sizeof(ServerConnection *));
+            if (grown != NULL) {
+                server->connections = grown;
+                server->connections_capacity = capacity;
+            }
+        }
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+        if (connection == NULL || server->num_connections == server->connections_capacity ||
+            epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            free(connection);
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->events = EPOLLIN;
+        server->connections[server->num_connections++] = connection;
+    }
+}
+
+// Read until the socket is drained or the buffer reaches SERVER_IN_LIMIT
+static void readConnection(ServerConnection *connection) {
+    while (connection->in_length < SERVER_IN_LIMIT) {
+        size_t room = SERVER_IN_LIMIT - connection->in_length;
+        if (room > 65536) {
+            room = 65536;
+        }
+        if (!reserveBytes(&connection->in, &connection->in_capacity, connection->in_length, room)) {
+            connection->closing = true;
+            return;
+        }
+        ssize_t n = read(connection->fd, connection->in + connection->in_length, room);
+        if (n > 0) {
+            connection->in_length += (size_t)n;
+        } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            connection->closing = true;
+            return;
+        } else if (errno == EAGAIN) {
+            return;
+        }
+    }
+}
+
+// Watch for input only while the connection has room for it and its
+// client keeps up with the replies, and for output while replies wait
+static void updateInterest(MatchServer *server, ServerConnection *connection) {
+    uint32_t events = 0;
+    if (!connection->closing && connection->in_length < SERVER_IN_LIMIT &&
+        connection->out_length < SERVER_OUT_LIMIT) {
+        events |= EPOLLIN;
+    }
+    if (connection->out_length > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events != connection->events) {
+        struct epoll_event event = {.events = events, .data.ptr = connection};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = events;
+    }
+}
+
+static void writeConnection(MatchServer *server, ServerConnection *connection) {
+    size_t sent = 0;
+    while (sent < connection->out_length) {
+        ssize_t n = send(connection->fd, connection->out + sent, connection->out_length - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n < 0 && errno != EAGAIN) {
+                // Peer is gone; nothing more can be delivered, including
+                // replies to requests still buffered
+                connection->closing = true;
+                connection->in_length = 0;
+                sent = connection->out_length;
+            }
+            break;
+        }
+    }
+    if (sent > 0) {
+        memmove(connection->out, connection->out + sent, connection->out_length - sent);
+        connection->out_length -= sent;
+    }
+    updateInterest(server, connection);
+}
+
+static bool queueReply(ServerConnection *connection, uint32_t id, ReplyStatus status) {
+    if (!reserveBytes(&connection->out, &connection->out_capacity, connection->out_length, SERVER_REPLY_SIZE)) {
+        return false;
+    }
+    unsigned char *reply = (unsigned char *)connection->out + connection->out_length;
+    putU32(reply, id);
+    reply[4] = (unsigned char)status;
+    connection->out_length += SERVER_REPLY_SIZE;
+    return true;
+}
+
+// Whether the connection's buffer starts with a complete, well-formed
+// request
+static bool hasRequest(const ServerConnection *connection) {
+    if (connection->in_length < SERVER_REQUEST_HEADER) {
+        return false;
+    }
+    uint32_t length = getU32((const unsigned char *)connection->in + 6);
+    return length <= SERVER_MAX_INPUT && connection->in_length >= SERVER_REQUEST_HEADER + length;
+}
+
+// Move complete requests from a connection into the batch. Returns false
+// when the batch filled up before the connection's buffer was drained. A
+// connection with too many unread replies is skipped until it catches up.
+static bool gatherRequests(MatchServer *server, ServerConnection *connection) {
+    size_t pos = 0;
+    bool drained = true;
+    if (connection->out_length >= SERVER_OUT_LIMIT) {
+        return true;
+    }
+    while (connection->in_length - pos >= SERVER_REQUEST_HEADER) {
+        const unsigned char *header = (const unsigned char *)connection->in + pos;
+        uint32_t id = getU32(header);
+        int automaton = header[4] | header[5] << 8;
+        uint32_t length = getU32(header + 6);
+        if (length > SERVER_MAX_INPUT) {
+            connection->closing = true;
+            break;
+        }
+        if (connection->in_length - pos < SERVER_REQUEST_HEADER + length) {
+            break;
+        }
+        if (server->num_requests == SERVER_MAX_BATCH) {
+            drained = false;
+            break;
+        }
+        const char *input = connection->in + pos + SERVER_REQUEST_HEADER;
+        ServerRequest *request = &server->requests[server->num_requests];
+        request->connection = connection;
+        request->id = id;
+        request->automaton = automaton;
+        request->reply = REPLY_ERROR;
+        // Inputs are C strings to the engines, so an embedded NUL is an error
+        if (automaton >= server->num_automata || memchr(input, '\0', length) != NULL ||
+            !reserveBytes(&server->arena, &server->arena_capacity, server->arena_length, length + 1)) {
+            request->automaton = -1;
+        } else {
+            request->input = server->arena_length;
+            memcpy(server->arena + server->arena_length, input, length);
+            server->arena[server->arena_length + length] = '\0';
+            server->arena_length += length + 1;
+        }
+        server->num_requests++;
+        pos += SERVER_REQUEST_HEADER + length;
+    }
+    if (pos > 0) {
+        memmove(connection->in, connection->in + pos, connection->in_length - pos);
+        connection->in_length -= pos;
+    }
+    return drained;
+}
+
+// Claim and match slices of the given batch until none are left
+static void runSlices(MatchServer *server, uint64_t generation) {
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        if (server->generation != generation || server->next_slice >= server->num_slices) {
+            pthread_mutex_unlock(&server->lock);
+            return;
+        }
+        int i = server->next_slice++;
+        pthread_mutex_unlock(&server->lock);
+        ServerSlice *slice = &server->slices[i];
+        acceptsBatchShared(server->automata[slice->automaton], server->inputs + slice->begin,
+                           slice->end - slice->begin, server->results + slice->begin);
+        pthread_mutex_lock(&server->lock);
+        if (--server->slices_left == 0) {
+            pthread_cond_signal(&server->work_done);
+        }
+        pthread_mutex_unlock(&server->lock);
+    }
+}
+
+static void *runServerWorker(void *arg) {
+    MatchServer *server = (MatchServer *)arg;
+    uint64_t seen = 0;
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (server->generation == seen && !server->stopping) {
+            pthread_cond_wait(&server->work_ready, &server->lock);
+        }
+        if (server->stopping) {
+            pthread_mutex_unlock(&server->lock);
+            return NULL;
+        }
+        seen = server->generation;
+        pthread_mutex_unlock(&server->lock);
+        runSlices(server, seen);
+    }
+}
+
+// Queue the reply of every request in the batch, in request order
+static void queueReplies(MatchServer *server) {
+    for (int i = 0; i < server->num_requests; i++) {
+        ServerRequest *request = &server->requests[i];
+        if (!queueReply(request->connection, request->id, request->reply)) {
+            request->connection->closing = true;
+        }
+    }
+}
+
+// Match the gathered batch: group requests by automaton, cut the groups
+// into slices for the workers, then queue the replies in request order
+static void runBatch(MatchServer *server) {
+    int n = server->num_requests;
+    int *order = (int *)malloc(sizeof(int) * (n ? n : 1));
+    int *starts = (int *)calloc(server->num_automata + 1, sizeof(int));
+    if (order == NULL || starts == NULL) {
+        // Every request still gets its (REPLY_ERROR) reply, or its client
+        // would wait forever
+        free(order);
+        free(starts);
+        queueReplies(server);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (server->requests[i].automaton >= 0) {
+            starts[server->requests[i].automaton + 1]++;
+        }
+    }
+    for (int a = 0; a < server->num_automata; a++) {
+        starts[a + 1] += starts[a];
+    }
+    int matched = starts[server->num_automata];
+    for (int i = 0; i < n; i++) {
+        ServerRequest *request = &server->requests[i];
+        if (request->automaton >= 0) {
+            int slot = starts[request->automaton]++;
+            order[slot] = i;
+            server->inputs[slot] = server->arena + request->input;
+        }
+    }
+
+    int num_slices = 0;
+    for (int begin = 0; begin < matched;) {
+        int automaton = server->requests[order[begin]].automaton;
+        int end = begin;
+        while (end < matched && end - begin < SERVER_SLICE &&
+               server->requests[order[end]].automaton == automaton) {
+            end++;
+        }
+        ServerSlice *slice = &server->slices[num_slices++];
+        slice->automaton = automaton;
+        slice->begin = begin;
+        slice->end = end;
+        begin = end;
+    }
+
+    if (num_slices > 0) {
+        // Published under the lock so a worker still finishing the last
+        // batch cannot claim from this one with stale counts
+        pthread_mutex_lock(&server->lock);
+        server->num_slices = num_slices;
+        server->next_slice = 0;
+        server->slices_left = num_slices;
+        uint64_t generation = ++server->generation;
+        pthread_cond_broadcast(&server->work_ready);
+        pthread_mutex_unlock(&server->lock);
+        // The loop thread helps rather than idling
+        runSlices(server, generation);
+        pthread_mutex_lock(&server->lock);
+        while (server->slices_left > 0) {
+            pthread_cond_wait(&server->work_done, &server->lock);
+        }
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    for (int slot = 0; slot < matched; slot++) {
+        server->requests[order[slot]].reply = server->results[slot] ? REPLY_ACCEPT : REPLY_REJECT;
+    }
+    queueReplies(server);
+    atomic_fetch_add(&server->served, (unsigned long long)n);
+    atomic_fetch_add(&server->batches, 1);
+    free(order);
+    free(starts);
+}
+
+static void *runServerLoop(void *arg) {
+    MatchServer *server = (MatchServer *)arg;
+    struct epoll_event events[64];
+    bool backlog = false;
+    for (;;) {
+        int ready = epoll_wait(server->epoll_fd, events, 64, backlog ? 0 : -1);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        bool stop = false;
+        for (int i = 0; i < ready; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &server->listen_fd) {
+                acceptConnections(server);
+            } else if (tag == &server->wake_fd) {
+                stop = true;
+            } else {
+                ServerConnection *connection = (ServerConnection *)tag;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    readConnection(connection);
+                }
+                // Hang-ups are reported even while input is not watched;
+                // the peer is gone either way
+                if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+                    connection->closing = true;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    writeConnection(server, connection);
+                }
+            }
+        }
+        if (stop) {
+            break;
+        }
+
+        // One batch from everything that has arrived
+        server->num_requests = 0;
+        server->arena_length = 0;
+        backlog = false;
+        for (int c = 0; c < server->num_connections; c++) {
+            if (!gatherRequests(server, server->connections[c])) {
+                backlog = true;
+            }
+        }
+        if (server->num_requests > 0) {
+            runBatch(server);
+        }
+        for (int c = server->num_connections - 1; c >= 0; c--) {
+            ServerConnection *connection = server->connections[c];
+            if (connection->out_length > 0) {
+                writeConnection(server, connection);
+            }
+            // A client that shut down its side still gets a reply to
+            // every request it sent before
+            bool pending = hasRequest(connection);
+            if (connection->closing && connection->out_length == 0 && !pending) {
+                closeConnection(server, c);
+            } else {
+                if (pending && connection->out_length < SERVER_OUT_LIMIT) {
+                    backlog = true;
+                }
+                updateInterest(server, connection);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Serve the given automata on a Unix socket at socket_path with an epoll
+// loop thread and a pool of workers. A stale socket file is replaced, but
+// one another server is listening on makes this fail.
+// Automaton i of a request is automata[i]; the caller keeps them alive
+// until matchServerStop. Returns NULL on failure.
+MatchServer* matchServerStart(const char *socket_path, CompiledDFA **automata, int count, int workers) {
+    struct sockaddr_un address;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return NULL;
+    }
+    MatchServer *server = (MatchServer *)calloc(1, sizeof(MatchServer));
+    if (server == NULL) {
+        return NULL;
+    }
+    server->automata = automata;
+    server->num_automata = count;
+    server->num_workers = workers > 0 ? workers : 0;
+    server->listen_fd = -1;
+    server->epoll_fd = -1;
+    server->wake_fd = -1;
+    server->socket_path = strdup(socket_path);
+    server->requests = (ServerRequest *)malloc(sizeof(ServerRequest) * SERVER_MAX_BATCH);
+    server->inputs = (const char **)malloc(sizeof(char *) * SERVER_MAX_BATCH);
+    server->results = (bool *)malloc(sizeof(bool) * SERVER_MAX_BATCH);
+    server->slices = (ServerSlice *)malloc(sizeof(ServerSlice) * SERVER_MAX_BATCH);
+    server->workers = (pthread_t *)malloc(sizeof(pthread_t) * (server->num_workers ? server->num_workers : 1));
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->work_ready, NULL);
+    pthread_cond_init(&server->work_done, NULL);
+    atomic_init(&server->served, 0);
+    atomic_init(&server->batches, 0);
+
+    bool ok = server->socket_path != NULL && server->requests != NULL && server->inputs != NULL &&
+              server->results != NULL && server->slices != NULL && server->workers != NULL;
+    if (ok) {
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, socket_path);
+        // Only a socket nobody accepts on is stale
+        struct stat st;
+        if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (probe >= 0) {
+                if (connect(probe, (struct sockaddr *)&address, sizeof(address)) != 0 && errno == ECONNREFUSED) {
+                    unlink(socket_path);
+                }
+                close(probe);
+            }
+        }
+        server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        server->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ok = server->listen_fd >= 0 && server->epoll_fd >= 0 && server->wake_fd >= 0 &&
+             bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        server->bound = ok;
+        ok = ok && listen(server->listen_fd, 128) == 0;
+    }
+    if (ok) {
+        struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = &server->listen_fd};
+        struct epoll_event wake_event = {.events = EPOLLIN, .data.ptr = &server->wake_fd};
+        ok = epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &listen_event) == 0 &&
+             epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wake_fd, &wake_event) == 0;
+    }
+
+    int started = 0;
+    for (; ok && started < server->num_workers; started++) {
+        if (pthread_create(&server->workers[started], NULL, runServerWorker, server) != 0) {
+            break;
+        }
+    }
+    server->num_workers = started;
+    if (ok && pthread_create(&server->loop, NULL, runServerLoop, server) == 0) {
+        return server;
+    }
+
+    // Failed: wind down whatever was started
+    pthread_mutex_lock(&server->lock);
+    server->stopping = true;
+    pthread_cond_broadcast(&server->work_ready);
+    pthread_mutex_unlock(&server->lock);
+    for (int t = 0; t < started; t++) {
+        pthread_join(server->workers[t], NULL);
+    }
+    server->num_workers = 0;
+    server->loop = pthread_self();
+    matchServerStop(server);
+    return NULL;
+}
+
+void matchServerStats(MatchServer *server, uint64_t *served, uint64_t *batches) {
+    *served = atomic_load(&server->served);
+    *batches = atomic_load(&server->batches);
+}
+
+// Stop serving, close every connection and remove the socket file
+void matchServerStop(MatchServer *server) {
+    if (server == NULL) {
+        return;
+    }
+    if (!pthread_equal(server->loop, pthread_self())) {
+        uint64_t one = 1;
+        if (write(server->wake_fd, &one, sizeof(one)) == sizeof(one)) {
+            pthread_join(server->loop, NULL);
+        }
+    }
+    pthread_mutex_lock(&server->lock);
+    server->stopping = true;
+    pthread_cond_broadcast(&server->work_ready);
+    pthread_mutex_unlock(&server->lock);
+    for (int t = 0; t < server->num_workers; t++) {
+        pthread_join(server->workers[t], NULL);
+    }
+
+    while (server->num_connections > 0) {
+        closeConnection(server, server->num_connections - 1);
+    }
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+    }
+    if (server->bound) {
+        unlink(server->socket_path);
+    }
+    if (server->epoll_fd >= 0) {
+        close(server->epoll_fd);
+    }
+    if (server->wake_fd >= 0) {
+        close(server->wake_fd);
+    }
+    pthread_mutex_destroy(&server->lock);
+    pthread_cond_destroy(&server->work_ready);
+    pthread_cond_destroy(&server->work_done);
+    free(server->connections);
+    free(server->requests);
+    free(server->arena);
+    free(server->inputs);
+    free(server->results);
+    free(server->slices);
+    free(server->workers);
+    free(server->socket_path);
+    free(server);
+}
+
+MatchClient* matchClientConnect(const char *socket_path) {
+    struct sockaddr_un address;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return NULL;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    MatchClient *client = (MatchClient *)malloc(sizeof(MatchClient));
+    if (client == NULL) {
+        close(fd);
+        return NULL;
+    }
+    client->fd = fd;
+    client->next_id = 0;
+    return client;
+}
+
+// Send requests while reading replies as they become readable, so
+// neither side's buffers have to hold the whole exchange
+static bool exchangeAll(int fd, const char *requests, size_t length, char *replies, size_t expected) {
+    size_t sent = 0, received = 0;
+    while (received < expected) {
+        struct pollfd pfd = {fd, POLLIN | (sent < length ? POLLOUT : 0), 0};
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (sent < length && (pfd.revents & POLLOUT)) {
+            ssize_t n = send(fd, requests + sent, length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0) {
+                sent += (size_t)n;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                return false;
+            }
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(fd, replies + received, expected - received, MSG_DONTWAIT);
+            if (n > 0) {
+                received += (size_t)n;
+            } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                return false;
+            }
+        }
+    }
+    return sent == length;
+}
+
+// Match inputs against one of the server's automata. Requests are
+// pipelined, so the server can batch them, with replies read as they
+// arrive.
+// Returns 0, or -1 if the connection failed.
+int matchClientQuery(MatchClient *client, int automaton, const char **inputs, int count, ReplyStatus *replies) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += SERVER_REQUEST_HEADER + strlen(inputs[i]);
+    }
+    char *requests = (char *)malloc(total ? total : 1);
+    char *reply_data = (char *)malloc((size_t)SERVER_REPLY_SIZE * (count ? count : 1));
+    if (requests == NULL || reply_data == NULL) {
+        free(requests);
+        free(reply_data);
+        return -1;
+    }
+
+    uint32_t first_id = client->next_id;
+    size_t pos = 0;
+    for (int i = 0; i < count; i++) {
+        size_t length = strlen(inputs[i]);
+        unsigned char *header = (unsigned char *)requests + pos;
+        putU32(header, first_id + (uint32_t)i);
+        header[4] = (unsigned char)automaton;
+        header[5] = (unsigned char)(automaton >> 8);
+        putU32(header + 6, (uint32_t)length);
+        memcpy(requests + pos + SERVER_REQUEST_HEADER, inputs[i], length);
+        pos += SERVER_REQUEST_HEADER + length;
+    }
+    client->next_id += (uint32_t)count;
+
+    bool ok = exchangeAll(client->fd, requests, total, reply_data, (size_t)SERVER_REPLY_SIZE * count);
+    for (int i = 0; ok && i < count; i++) {
+        const unsigned char *reply = (const unsigned char *)reply_data + (size_t)i * SERVER_REPLY_SIZE;
+        ok = getU32(reply) == first_id + (uint32_t)i;
+        replies[i] = (ReplyStatus)reply[4];
+    }
+    free(requests);
+    free(reply_data);
+    return ok ? 0 : -1;
+}
+
+void matchClientClose(MatchClient *client) {
+    if (client != NULL) {
+        close(client->fd);
+        free(client);
+    }
+}
+
+static StreamTask *taskAlloc(StreamScheduler *scheduler) {
+    pthread_mutex_lock(&scheduler->pool_lock);
+    if (scheduler->free_tasks == NULL) {
+        StreamTask *slab = (StreamTask *)calloc(TASK_SLAB, sizeof(StreamTask));
+        StreamTask **slabs = (StreamTask **)realloc(scheduler->slabs,
+                                                    (scheduler->num_slabs + 1) * sizeof(StreamTask *));
+        if (slabs != NULL) {
+            scheduler->slabs = slabs;
+        }
+        if (slab == NULL || slabs == NULL) {
+            free(slab);
+            pthread_mutex_unlock(&scheduler->pool_lock);
+            return NULL;
+        }
+        scheduler->slabs[scheduler->num_slabs++] = slab;
+        for (int i = 0; i < TASK_SLAB; i++) {
+            slab[i].next_free = scheduler->free_tasks;
+            scheduler->free_tasks = &slab[i];
+        }
+    }
+    StreamTask *task = scheduler->free_tasks;
+    scheduler->free_tasks = task->next_free;
+    task->in_use = true;
+    pthread_mutex_unlock(&scheduler->pool_lock);
+    return task;
+}
+
+static void taskFree(StreamScheduler *scheduler, StreamTask *task) {
+    pthread_mutex_lock(&scheduler->pool_lock);
+    task->in_use = false;
+    task->next_free = scheduler->free_tasks;
+    scheduler->free_tasks = task;
+    pthread_mutex_unlock(&scheduler->pool_lock);
+}
+
+// Match a buffer of the stream, one record per line
+static void taskMatch(StreamScheduler *scheduler, StreamTask *task, const char *data, size_t length) {
+    CompiledDFA *dfa = scheduler->dfa;
+    const int *table = dfa->table;
+    int state = task->dfa_state;
+    size_t i = 0;
+    while (i < length) {
+        unsigned char c = (unsigned char)data[i];
+        if (c == '\n') {
+            if (compiledAccepting(dfa, state)) {
+                task->matches++;
+                if (scheduler->on_match != NULL) {
+                    scheduler->on_match(scheduler->context, task->id, task->records);
+                }
+            }
+            task->records++;
+            task->open_record = false;
+            state = dfa->start;
+            i++;
+            continue;
+        }
+        task->open_record = true;
+        state = table[state + c];
+        if (state == dfa->dead) {
+            // Nothing more on this line can match: skip to its end
+            const char *newline = memchr(data + i, '\n', length - i);
+            i = newline != NULL ? (size_t)(newline - data) : length;
+            continue;
+        }
+        i++;
+    }
+    task->dfa_state = state;
+}
+
+static void taskFinish(StreamScheduler *scheduler, StreamTask *task, int error) {
+    if (task->open_record) {
+        if (compiledAccepting(scheduler->dfa, task->dfa_state)) {
+            task->matches++;
+            if (scheduler->on_match != NULL) {
+                scheduler->on_match(scheduler->context, task->id, task->records);
+            }
+        }
+        task->records++;
+    }
+    epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_DEL, task->fd, NULL);
+    close(task->fd);
+    if (scheduler->on_close != NULL) {
+        scheduler->on_close(scheduler->context, task->id, task->records, task->matches, error);
+    }
+    taskFree(scheduler, task);
+    atomic_fetch_sub(&scheduler->active, 1);
+}
+
+// Resume a task: read and match until the fd would block (suspend), the
+// quantum is used up (yield) or the stream ends (finish)
+static void taskResume(StreamScheduler *scheduler, StreamTask *task, char *buffer) {
+    size_t budget = TASK_QUANTUM;
+    for (;;) {
+        ssize_t n = read(task->fd, buffer, TASK_QUANTUM);
+        if (n > 0) {
+            taskMatch(scheduler, task, buffer, (size_t)n);
+            if ((size_t)n >= budget) {
+                break;
+            }
+            budget -= (size_t)n;
+        } else if (n == 0) {
+            taskFinish(scheduler, task, 0);
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            taskFinish(scheduler, task, errno);
+            return;
+        }
+    }
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = task};
+    epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_MOD, task->fd, &event);
+}
+
+// Worker: the shared epoll set is the run queue. One-shot registrations
+// hand each ready task to exactly one worker until it suspends again.
+static void *runStreamWorker(void *arg) {
+    StreamScheduler *scheduler = (StreamScheduler *)arg;
+    char *buffer = (char *)malloc(TASK_QUANTUM);
+    struct epoll_event events[64];
+    bool stop = buffer == NULL;
+    while (!stop) {
+        int ready = epoll_wait(scheduler->epoll_fd, events, 64, -1);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == &scheduler->wake_fd) {
+                stop = true;
+            } else {
+                taskResume(scheduler, (StreamTask *)events[i].data.ptr, buffer);
+            }
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Start workers threads (one per online CPU if workers is 0). on_match is
+// called for every matching line and on_close when a stream ends, both
+// from worker threads; either may be NULL.
+StreamScheduler* streamSchedulerCreate(CompiledDFA *dfa, int workers, StreamMatchCallback on_match,
+                                       StreamCloseCallback on_close, void *context) {
+    StreamScheduler *scheduler = (StreamScheduler *)calloc(1, sizeof(StreamScheduler));
+    if (scheduler == NULL) {
+        return NULL;
+    }
+    if (workers <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (int)cpus : 1;
+    }
+    scheduler->dfa = dfa;
+    scheduler->on_match = on_match;
+    scheduler->on_close = on_close;
+    scheduler->context = context;
+    atomic_init(&scheduler->active, 0);
+    pthread_mutex_init(&scheduler->pool_lock, NULL);
+    scheduler->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    scheduler->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    scheduler->workers = (pthread_t *)malloc(sizeof(pthread_t) * workers);
+
+    // The wake event stays readable once signalled, so it reaches every worker
+    struct epoll_event wake_event = {.events = EPOLLIN, .data.ptr = &scheduler->wake_fd};
+    if (scheduler->epoll_fd < 0 || scheduler->wake_fd < 0 || scheduler->workers == NULL ||
+        epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, scheduler->wake_fd, &wake_event) != 0) {
+        streamSchedulerStop(scheduler);
+        return NULL;
+    }
+    for (; scheduler->num_workers < workers; scheduler->num_workers++) {
+        if (pthread_create(&scheduler->workers[scheduler->num_workers], NULL,
+                           runStreamWorker, scheduler) != 0) {
+            break;
+        }
+    }
+    if (scheduler->num_workers == 0) {
+        streamSchedulerStop(scheduler);
+        return NULL;
+    }
+    return scheduler;
+}
+
+// Hand a stream to the scheduler. The fd is made nonblocking and is
+// closed by the scheduler when the stream ends or the scheduler stops.
+// Returns 0, or -1 (the fd is left open) on failure.
+int streamSchedulerAttach(StreamScheduler *scheduler, int fd, uint64_t stream) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        return -1;
+    }
+    StreamTask *task = taskAlloc(scheduler);
+    if (task == NULL) {
+        return -1;
+    }
+    task->fd = fd;
+    task->dfa_state = scheduler->dfa->start;
+    task->open_record = false;
+    task->id = stream;
+    task->records = 0;
+    task->matches = 0;
+    atomic_fetch_add(&scheduler->active, 1);
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = task};
+    if (epoll_ctl(scheduler->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        atomic_fetch_sub(&scheduler->active, 1);
+        taskFree(scheduler, task);
+        return -1;
+    }
+    return 0;
+}
+
+// Streams attached and not yet finished
+long streamSchedulerActive(StreamScheduler *scheduler) {
+    return atomic_load(&scheduler->active);
+}
+
+// Stop the workers and close every stream still attached, without
+// calling on_close for them
+void streamSchedulerStop(StreamScheduler *scheduler) {
+    if (scheduler == NULL) {
+        return;
+    }
+    if (scheduler->num_workers > 0) {
+        uint64_t one = 1;
+        if (write(scheduler->wake_fd, &one, sizeof(one)) == sizeof(one)) {
+            for (int t = 0; t < scheduler->num_workers; t++) {
+                pthread_join(scheduler->workers[t], NULL);
+            }
+        }
+    }
+    for (int s = 0; s < scheduler->num_slabs; s++) {
+        for (int i = 0; i < TASK_SLAB; i++) {
+            if (scheduler->slabs[s][i].in_use) {
+                close(scheduler->slabs[s][i].fd);
+            }
+        }
+        free(scheduler->slabs[s]);
+    }
+    if (scheduler->epoll_fd >= 0) {
+        close(scheduler->epoll_fd);
+    }
+    if (scheduler->wake_fd >= 0) {
+        close(scheduler->wake_fd);
+    }
+    pthread_mutex_destroy(&scheduler->pool_lock);
+    free(scheduler->slabs);
+    free(scheduler->workers);
+    free(scheduler);
+}
+#endif
+
+// Print state set
+void printStateSet(StateSet *set) {
+    printf("{");
+    for (int i = 0; i < set->size; i++) {
+        printf("%d", set->states[i]);
+        if (i < set->size - 1) printf(",");
+    }
+    printf("}");
+}
+
+// Per-thread latency counters. Only the owning thread writes them, so
+// relaxed loads and stores are enough and recording never takes a lock;
+// other threads read them while merging. Recorders are never freed so
+// samples from exited threads still show up in merges.
+typedef struct LatencyRecorder {
+    _Atomic uint64_t counts[NUM_ENGINES][LATENCY_LENGTH_CLASSES][LATENCY_BUCKETS];
+    _Atomic uint64_t max_ns[NUM_ENGINES][LATENCY_LENGTH_CLASSES];
+    struct LatencyRecorder *next;
+} LatencyRecorder;
+
+static _Atomic(LatencyRecorder *) latency_recorders;
+static _Thread_local LatencyRecorder *thread_recorder;
+
+// Turn latency recording around the match APIs on or off
+void latencyEnable(bool enabled) {
+    atomic_store(&latency_enabled, enabled);
+}
+
+// Map a latency to its histogram bucket
+static int latencyBucket(uint64_t ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return (int)ns;
+    }
+
+    int magnitude = 63 - __builtin_clzll(ns);
+    int shift = magnitude - LATENCY_SUB_BUCKET_BITS;
+    int index = (shift + 1) * LATENCY_SUB_BUCKETS +
+                (int)((ns >> shift) - LATENCY_SUB_BUCKETS);
+    return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+// Largest latency that falls into a bucket
+static uint64_t latencyBucketLimit(int index) {
+    if (index < LATENCY_SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+
+    int shift = index / LATENCY_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t)(index % LATENCY_SUB_BUCKETS) + LATENCY_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+// Map an input length to its length class
+static int latencyLengthClass(size_t input_length) {
+    if (input_length == 0) {
+        return 0;
+    }
+
+    int length_class = 64 - __builtin_clzll((unsigned long long)input_length);
+    return length_class < LATENCY_LENGTH_CLASSES ? length_class
+                                                 : LATENCY_LENGTH_CLASSES - 1;
+}
+
+// Record one match call into the calling thread's histograms
+void latencyRecord(Engine engine, size_t input_length, uint64_t ns) {
+    LatencyRecorder *recorder = thread_recorder;
+    if (recorder == NULL) {
+        recorder = calloc(1, sizeof(LatencyRecorder));
+        if (recorder == NULL) {
+            return;
+        }
+        recorder->next = atomic_load(&latency_recorders);
+        while (!atomic_compare_exchange_weak(&latency_recorders, &recorder->next, recorder)) {
+        }
+        thread_recorder = recorder;
+    }
+
+    int length_class = latencyLengthClass(input_length);
+    _Atomic uint64_t *count = &recorder->counts[engine][length_class][latencyBucket(ns)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+
+    _Atomic uint64_t *max_ns = &recorder->max_ns[engine][length_class];
+    if (ns > atomic_load_explicit(max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(max_ns, ns, memory_order_relaxed);
+    }
+}
+
+// Merge every thread's samples into one histogram per engine and length class
+void latencyMerge(LatencyHistogram out[NUM_ENGINES][LATENCY_LENGTH_CLASSES]) {
+    memset(out, 0, sizeof(LatencyHistogram) * NUM_ENGINES * LATENCY_LENGTH_CLASSES);
+
+    for (LatencyRecorder *recorder = atomic_load(&latency_recorders);
+         recorder != NULL; recorder = recorder->next) {
+        for (int e = 0; e < NUM_ENGINES; e++) {
+            for (int l = 0; l < LATENCY_LENGTH_CLASSES; l++) {
+                LatencyHistogram *hist = &out[e][l];
+                for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                    uint64_t count = atomic_load_explicit(&recorder->counts[e][l][b],
+                                                          memory_order_relaxed);
+                    hist->counts[b] += count;
+                    hist->total += count;
+                }
+                uint64_t max_ns = atomic_load_explicit(&recorder->max_ns[e][l],
+                                                       memory_order_relaxed);
+                if (max_ns > hist->max_ns) {
+                    hist->max_ns = max_ns;
+                }
+            }
+        }
+    }
+}
+
+// Latency at the given percentile (0-100), reported as the bucket's upper bound
+uint64_t latencyPercentile(LatencyHistogram *hist, double percentile) {
+    if (hist->total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)hist->total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > hist->total) rank = hist->total;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += hist->counts[b];
+        if (seen >= rank) {
+            uint64_t limit = latencyBucketLimit(b);
+            return limit < hist->max_ns ? limit : hist->max_ns;
+        }
+    }
+    return hist->max_ns;
+}
+
+// Write merged latency percentiles as CSV, one row per non-empty bucket
+void latencyExport(FILE *out) {
+    LatencyHistogram *merged = malloc(sizeof(LatencyHistogram) * NUM_ENGINES *
+                                      LATENCY_LENGTH_CLASSES);
+    if (merged == NULL) {
+        return;
+    }
+    latencyMerge((LatencyHistogram (*)[LATENCY_LENGTH_CLASSES])merged);
+
+    fprintf(out, "engine,min_length,count,p50_ns,p99_ns,p999_ns,max_ns\n");
+    for (int e = 0; e < NUM_ENGINES; e++) {
+        for (int l = 0; l < LATENCY_LENGTH_CLASSES; l++) {
+            LatencyHistogram *hist = &merged[e * LATENCY_LENGTH_CLASSES + l];
+            if (hist->total == 0) {
+                continue;
+            }
+            fprintf(out, "%s,%zu,%llu,%llu,%llu,%llu,%llu\n", engine_names[e],
+                    l == 0 ? (size_t)0 : (size_t)1 << (l - 1),
+                    (unsigned long long)hist->total,
+                    (unsigned long long)latencyPercentile(hist, 50.0),
+                    (unsigned long long)latencyPercentile(hist, 99.0),
+                    (unsigned long long)latencyPercentile(hist, 99.9),
+                    (unsigned long long)hist->max_ns);
+        }
+    }
+
+    free(merged);
+}
+
+#ifdef __linux__
+// Demo callback: record each stream's counts as it ends
+static void recordStreamClose(void *context, uint64_t stream, uint64_t records, uint64_t matches, int error) {
+    uint64_t (*counts)[2] = (uint64_t (*)[2])context;
+    counts[stream][0] = error == 0 ? matches : 0;
+    counts[stream][1] = records;
+}
+#endif
+
+// Demo stage: pass on the lines the DFA accepts and drop the rest
+static bool filterMatchingLines(void *context, Block *block) {
+    return acceptsCompiled((CompiledDFA *)context, block->data);
+}
+
+// Main function with example usage
+int main() {
+    FSA fsa;
+    initFSA(&fsa);
+
+    // Build the example FSA from the assignment
+    addState(&fsa, 0, true, false);
+    addState(&fsa, 1, false, false);
+    addState(&fsa, 2, false, false);
+    addState(&fsa, 3, false, false);
+    addState(&fsa, 4, false, false);
+    addState(&fsa, 5, false, false);
+    addState(&fsa, 6, false, false);
+    addState(&fsa, 7, false, false);
+    addState(&fsa, 8, false, false);
+    addState(&fsa, 9, false, false);
+    addState(&fsa, 10, false, true);
+
+    // Add transitions (epsilon is '\0')
+    addTransition(&fsa, 0, 1, EPSILON);
+    addTransition(&fsa, 0, 7, EPSILON);
+    addTransition(&fsa, 1, 2, EPSILON);
+    addTransition(&fsa, 1, 4, EPSILON);
+    addTransition(&fsa, 2, 3, 'a');
+    addTransition(&fsa, 3, 6, EPSILON);
+    addTransition(&fsa, 4, 5, 'b');
+    addTransition(&fsa, 5, 6, EPSILON);
+    addTransition(&fsa, 6, 1, EPSILON);
+    addTransition(&fsa, 6, 7, EPSILON);
+    addTransition(&fsa, 7, 8, 'a');
+    addTransition(&fsa, 8, 9, 'b');
+    addTransition(&fsa, 9, 10, 'b');
+
+    // Test operations
+    printf("Testing FSA Operations:\n\n");
+
+    // Test closure
+    printf("Closure of state 3: ");
+    StateSet c = closure(&fsa, 3);
+    printStateSet(&c);
+    printf("\n\n");
+
+    // Test next
+    printf("Next from state 4 with 'b': ");
+    StateSet n = next(&fsa, 4, 'b');
+    printStateSet(&n);
+    printf("\n\n");
+
+    // Test deterministic
+    printf("Is deterministic: %s\n\n", deterministic(&fsa) ? "true" : "false");
+
+    // Test accepts
+    printf("Accepts 'abb': %s\n", accepts(&fsa, "abb") ? "true" : "false");
+    printf("Accepts 'aabb': %s\n", accepts(&fsa, "aabb") ? "true" : "false");
+    printf("Accepts 'babb': %s\n", accepts(&fsa, "babb") ? "true" : "false");
+    printf("Accepts 'ab': %s\n\n", accepts(&fsa, "ab") ? "true" : "false");
+
+    // Convert to DFA
+    printf("Converting to DFA...\n");
+    FSA *dfa = toDFA(&fsa);
+    if (dfa == NULL) {
+        printf("DFA would exceed MAX_STATES or MAX_TRANSITIONS\n");
+        return 1;
+    }
+    printf("DFA has %d states\n", dfa->num_states);
+    printf("DFA is deterministic: %s\n\n", deterministic(dfa) ? "true" : "false");
+
+    // Test DFA accepts same strings
+    printf("DFA accepts 'abb': %s\n", accepts(dfa, "abb") ? "true" : "false");
+    printf("DFA accepts 'aabb': %s\n", accepts(dfa, "aabb") ? "true" : "false");
+
+    // Compiled DFA and budgeted matching
+    static const char *status_names[] = {"reject", "accept", "budget exceeded"};
+    CompiledDFA *compiled = compileDFA(dfa);
+    printf("\nCompiled DFA accepts 'babb': %s\n",
+           acceptsCompiled(compiled, "babb") ? "true" : "false");
+    printf("Budgeted NFA 'aabb' (budget 100000): %s\n",
+           status_names[acceptsBudgeted(&fsa, NULL, "aabb", 100000)]);
+    printf("Budgeted NFA 'aabb' (budget 100): %s\n",
+           status_names[acceptsBudgeted(&fsa, NULL, "aabb", 100)]);
+    printf("Budgeted DFA 'aabb' (budget 100): %s\n",
+           status_names[acceptsBudgeted(&fsa, compiled, "aabb", 100)]);
+
+    // Checkpoint a stream midway and resume it in a fresh matcher
+    unsigned char blob[CHECKPOINT_MAX_SIZE];
+    StreamMatcher stream, resumed;
+    streamInit(&stream, &fsa, NULL);
+    streamFeed(&stream, "ab", 2);
+    size_t blob_size = streamCheckpoint(&stream, blob, sizeof(blob));
+    streamInit(&resumed, &fsa, NULL);
+    bool restored = streamRestore(&resumed, blob, blob_size);
+    streamFeed(&resumed, "abb", 3);
+    printf("\nStream 'ab'|'abb' restored from %zu-byte checkpoint: %s, accepting: %s\n",
+           blob_size, restored ? "true" : "false",
+           streamAccepting(&resumed) ? "true" : "false");
+
+    // Count accepted strings per length
+    char *exact = countAccepted(compiled, 100);
+    printf("\nAccepted strings of length 10: %llu, of length 100: %s\n",
+           (unsigned long long)countAcceptedMod(compiled, 10, UINT64_MAX), exact);
+    free(exact);
+    CountGenerating gf;
+    uint64_t counts[9];
+    countGeneratingFunction(compiled, 1000000007ull, &gf);
+    countAcceptedUpTo(&gf, 8, counts);
+    printf("Recurrence order %d, counts for lengths 0-8:", gf.order);
+    for (int i = 0; i <= 8; i++) {
+        printf(" %llu", (unsigned long long)counts[i]);
+    }
+    printf("\n");
+
+    // Shortest witness and the first few accepted strings in order
+    char witness[64];
+    long witness_length = shortestAccepted(compiled, witness, sizeof(witness));
+    printf("Shortest accepted string: '%s' (length %ld)\nEnumerated:", witness, witness_length);
+    WitnessIterator *witnesses = witnessIterCreate(compiled, 5);
+    while (witnessIterNext(witnesses, witness, sizeof(witness)) >= 0) {
+        printf(" %s", witness);
+    }
+    printf("\n");
+    freeWitnessIter(witnesses);
+
+    // Sample accepted strings of length 6 on two threads
+    Sampler *sampler = samplerCreate(compiled, 6);
+    char samples[4 * 7];
+    samplerBulk(sampler, 4, 2, 42, samples);
+    printf("Sampled:");
+    for (int i = 0; i < 4; i++) {
+        printf(" %s", samples + i * 7);
+    }
+    printf("\n");
+    freeSampler(sampler);
+
+    // Best-path cost of a weighted automaton, before and after
+    // determinization
+    WeightedFSA *weighted = (WeightedFSA *)malloc(sizeof(WeightedFSA));
+    initWeightedFSA(weighted, SEMIRING_TROPICAL);
+    for (int i = 0; i <= 3; i++) {
+        addState(&weighted->base, i, i == 0, i == 3);
+    }
+    addWeightedTransition(weighted, 0, 1, 'a', 1.0);
+    addWeightedTransition(weighted, 0, 2, 'a', 2.0);
+    addWeightedTransition(weighted, 1, 3, 'b', 3.0);
+    addWeightedTransition(weighted, 2, 3, 'b', 1.0);
+    WeightedFSA *weighted_dfa = weightedDeterminize(weighted);
+    printf("Tropical weight of 'ab': %.1f, after determinization: %.1f (%d states)\n",
+           weightedScore(weighted, "ab"), weightedScore(weighted_dfa, "ab"),
+           weighted_dfa->base.num_states);
+    free(weighted_dfa);
+    free(weighted);
+
+    // Alert on a match of (a|b)*abb within the last 4 bytes of a stream
+    WindowMatcher *window = windowMatcherCreate(compiled, 4);
+    uint64_t last_end = 0;
+    size_t window_hits = windowFeed(window, "abbaabxabb", 10, &last_end);
+    printf("Window matches: %zu, last ending at offset %llu\n",
+           window_hits, (unsigned long long)last_end);
+    freeWindowMatcher(window);
+
+    // Check bracket nesting of JSON-like text in one pass: '[' and '{'
+    // push, ']' and '}' pop, and each return must match its call
+    VPA *nested = (VPA *)malloc(sizeof(VPA));
+    initVPA(nested);
+    addState(&nested->base, 0, true, true);
+    setSymbolKind(nested, '[', SYMBOL_CALL);
+    setSymbolKind(nested, '{', SYMBOL_CALL);
+    setSymbolKind(nested, ']', SYMBOL_RETURN);
+    setSymbolKind(nested, '}', SYMBOL_RETURN);
+    addCallTransition(nested, 0, 0, '[', 0);
+    addCallTransition(nested, 0, 0, '{', 1);
+    addReturnTransition(nested, 0, 0, ']', 0);
+    addReturnTransition(nested, 0, 0, '}', 1);
+    for (const char *p = "abc:,"; *p != '\0'; p++) {
+        addTransition(&nested->base, 0, 0, *p);
+    }
+    const char *nested_tests[] = {"{a:[b,c]}", "{a:[b}]", "[[a]"};
+    for (int i = 0; i < 3; i++) {
+        printf("Nesting '%s': %s\n", nested_tests[i],
+               vpaAccepts(nested, nested_tests[i]) ? "ACCEPTED" : "REJECTED");
+    }
+    free(nested);
+
+    // Count matching lines of a file with reads in flight through io_uring
+    char ingest_path[] = "/tmp/fsa-ingest-XXXXXX";
+    int ingest_fd = mkstemp(ingest_path);
+    if (ingest_fd >= 0) {
+        const char *lines = "abb\nab\nbabb\n";
+        if (write(ingest_fd, lines, strlen(lines)) == (ssize_t)strlen(lines)) {
+            const char *ingest_paths[] = {ingest_path};
+            IngestOptions ingest_options = {64 * 1024, 4, 1, false, false};
+            IngestResult ingest_result;
+            if (ingestFiles(compiled, ingest_paths, 1, &ingest_options, &ingest_result) == 0) {
+                printf("Ingested %llu bytes: %llu of %llu lines match\n",
+                       (unsigned long long)ingest_result.bytes,
+                       (unsigned long long)ingest_result.matches,
+                       (unsigned long long)ingest_result.records);
+            }
+            // Same file through the decompress-and-match pipeline (plain
+            // input is copied through)
+            if (scanCompressedFiles(compiled, ingest_paths, 1, 1, &ingest_result) == 0) {
+                printf("Decompress-and-match: %llu of %llu lines match\n",
+                       (unsigned long long)ingest_result.matches,
+                       (unsigned long long)ingest_result.records);
+            }
+        }
+        close(ingest_fd);
+        unlink(ingest_path);
+    }
+
+    // Scan a small directory tree for matching lines
+    char scan_root[] = "/tmp/fsa-scan-XXXXXX";
+    if (mkdtemp(scan_root) != NULL) {
+        const char *scan_names[] = {"one.log", "two.log"};
+        const char *scan_texts[] = {"ab\nabb\n", "babb\nba\naabb"};
+        char scan_path[64];
+        for (int i = 0; i < 2; i++) {
+            snprintf(scan_path, sizeof(scan_path), "%s/%s", scan_root, scan_names[i]);
+            FILE *out = fopen(scan_path, "w");
+            if (out != NULL) {
+                fputs(scan_texts[i], out);
+                fclose(out);
+            }
+        }
+        ScanOptions scan_options = {2, 4, true};
+        ScanReport scan_report;
+        if (scanDirectory(compiled, scan_root, &scan_options, &scan_report) == 0) {
+            for (size_t i = 0; i < scan_report.count; i++) {
+                printf("%s:%llu:%s\n", strrchr(scan_report.matches[i].path, '/') + 1,
+                       (unsigned long long)scan_report.matches[i].line, scan_report.matches[i].text);
+            }
+            freeScanReport(&scan_report);
+        }
+        for (int i = 0; i < 2; i++) {
+            snprintf(scan_path, sizeof(scan_path), "%s/%s", scan_root, scan_names[i]);
+            unlink(scan_path);
+        }
+        rmdir(scan_root);
+    }
+
+#ifdef __linux__
+    // Serve the compiled DFA over a Unix socket and query it
+    char socket_path[64];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/fsa-%d.sock", (int)getpid());
+    CompiledDFA *served[] = {compiled};
+    MatchServer *server = matchServerStart(socket_path, served, 1, 2);
+    MatchClient *client = server != NULL ? matchClientConnect(socket_path) : NULL;
+    if (client != NULL) {
+        const char *queries[] = {"abb", "ab", "babb"};
+        ReplyStatus replies[3];
+        if (matchClientQuery(client, 0, queries, 3, replies) == 0) {
+            printf("Daemon replies:");
+            for (int i = 0; i < 3; i++) {
+                printf(" %s=%s", queries[i], replies[i] == REPLY_ACCEPT ? "ACCEPTED" : "REJECTED");
+            }
+            printf("\n");
+        }
+        matchClientClose(client);
+    }
+    matchServerStop(server);
+
+    // Multiplex two socket streams over two workers; lines that straddle
+    // writes are matched as the tasks resume
+    uint64_t stream_counts[2][2] = {{0, 0}, {0, 0}};
+    StreamScheduler *scheduler = streamSchedulerCreate(compiled, 2, NULL, recordStreamClose, stream_counts);
+    int writers[2] = {-1, -1};
+    for (int i = 0; scheduler != NULL && i < 2; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0) {
+            if (streamSchedulerAttach(scheduler, pair[1], (uint64_t)i) == 0) {
+                writers[i] = pair[0];
+            } else {
+                close(pair[0]);
+                close(pair[1]);
+            }
+        }
+    }
+    const char *stream_parts[] = {"abb\nba", "bb\nab\n", "aab", "b\n"};
+    for (int i = 0; i < 4; i++) {
+        int w = writers[i % 2];
+        if (w >= 0 && write(w, stream_parts[i], strlen(stream_parts[i])) < 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (writers[i] >= 0) {
+            close(writers[i]);
+        }
+    }
+    while (scheduler != NULL && streamSchedulerActive(scheduler) > 0) {
+        sched_yield();
+    }
+    streamSchedulerStop(scheduler);
+    for (int i = 0; i < 2; i++) {
+        printf("Stream %d: %llu of %llu lines match\n", i,
+               (unsigned long long)stream_counts[i][0], (unsigned long long)stream_counts[i][1]);
+    }
+#endif
+
+    // Filter lines through a two-thread stage between bounded rings; the
+    // source stalls whenever the stage falls behind
+    Pipeline *pipeline = pipelineCreate(4, WAIT_BLOCK);
+    if (pipeline != NULL && pipelineAddStage(pipeline, filterMatchingLines, compiled, 2) == 0 &&
+        pipelineStart(pipeline) == 0) {
+        char *pipeline_lines[] = {"abb", "ab", "babb", "ba", "aabb", "bbb", "abab", "ababb"};
+        for (int i = 0; i < 8; i++) {
+            Block line = {pipeline_lines[i], strlen(pipeline_lines[i]), i, 0, false};
+            pipelinePush(pipeline, &line);
+        }
+        pipelineFinish(pipeline);
+        int passed = 0;
+        Block out;
+        while (pipelinePop(pipeline, &out)) {
+            passed++;
+        }
+        uint64_t stage_items, stage_bytes, stage_ns;
+        pipelineStageStats(pipeline, 0, &stage_items, &stage_bytes, &stage_ns);
+        printf("\nPipeline: %d of %llu lines match (%llu bytes filtered in %llu ns)\n", passed,
+               (unsigned long long)stage_items, (unsigned long long)stage_bytes,
+               (unsigned long long)stage_ns);
+    }
+    freePipeline(pipeline);
+
+    // Redact a log line fed in two chunks that split a match
+    const char *secrets[] = {"password", "token"};
+    const char *masks[] = {"********", "*****"};
+    Transducer *redactor = redactionTransducer(secrets, masks, 2);
+    TransducerStream redacting;
+    transducerInit(&redacting, redactor);
+    const char *log_line = "user=bob password=hunter2 token=abc pass=ok";
+    char redacted[256];
+    long redacted_length = transducerFeed(&redacting, log_line, 13, redacted, sizeof(redacted));
+    redacted_length += transducerFeed(&redacting, log_line + 13, strlen(log_line) - 13,
+                                      redacted + redacted_length, sizeof(redacted) - redacted_length);
+    redacted_length += transducerFinish(&redacting, redacted + redacted_length,
+                                        sizeof(redacted) - redacted_length);
+    printf("Redacted: %.*s\n", (int)redacted_length, redacted);
+    freeTransducer(redactor);
+
+    // Scan one input with two automata at once: (a|b)*abb and (a|b)*b
+    FSA ends_b;
+    initFSA(&ends_b);
+    addState(&ends_b, 0, true, false);
+    addState(&ends_b, 1, false, true);
+    addTransition(&ends_b, 0, 0, 'a');
+    addTransition(&ends_b, 0, 1, 'b');
+    addTransition(&ends_b, 1, 0, 'a');
+    addTransition(&ends_b, 1, 1, 'b');
+    CompiledDFA *ends_b_compiled = compileDFA(&ends_b);
+    CompiledDFA *group_dfas[] = {compiled, ends_b_compiled};
+    ScanGroup *group = scanGroupCreate(group_dfas, 2);
+    scanGroupFeed(group, "babab", 5);
+    printf("\nScan group on 'babab': abb=%s, b=%s\n",
+           scanGroupAccepting(group, 0) ? "true" : "false",
+           scanGroupAccepting(group, 1) ? "true" : "false");
+    scanGroupFeed(group, "b", 1);
+    printf("Scan group on 'bababb': abb=%s, b=%s\n",
+           scanGroupAccepting(group, 0) ? "true" : "false",
+           scanGroupAccepting(group, 1) ? "true" : "false");
+    freeScanGroup(group);
+
+    // Split the NFA's two start branches into shards and scan with both
+    ShardSet *shards = shardAutomaton(&fsa, 2);
+    MatchEvent *events = NULL;
+    size_t num_events = shardScan(shards, "abbabb", 6, &events);
+    printf("\n%d shards, matches in 'abbabb':", shards->num_shards);
+    for (size_t i = 0; i < num_events; i++) {
+        printf(" %llu(shard %d)", (unsigned long long)events[i].offset, events[i].shard);
+    }
+    printf("\n");
+    free(events);
+    freeShardSet(shards);
+
+    // A branch that loops back to the start cannot be split off:
+    // a*b stays one shard
+    FSA looping;
+    initFSA(&looping);
+    addState(&looping, 0, true, false);
+    addState(&looping, 1, false, true);
+    addTransition(&looping, 0, 0, 'a');
+    addTransition(&looping, 0, 1, 'b');
+    shards = shardAutomaton(&looping, 2);
+    num_events = shards != NULL ? shardScan(shards, "abab", 4, &events) : 0;
+    printf("%d shard(s) for a*b, matches in 'abab':", shards != NULL ? shards->num_shards : 0);
+    for (size_t i = 0; i < num_events; i++) {
+        printf(" %llu", (unsigned long long)events[i].offset);
+    }
+    printf("\n");
+    if (shards != NULL) {
+        free(events);
+    }
+    freeShardSet(shards);
+
+    // Let the meta-engine pick an engine
+    Matcher *matcher = matcherCreate(&fsa);
+    printf("\nMatcher: %d states, epsilon density %.2f, estimated DFA states %d\n",
+           matcher->stats.num_states, matcher->stats.epsilon_density,
+           matcher->stats.estimated_dfa_states);
+    printf("Matcher engine %s accepts 'babb': %s\n", engine_names[matcher->engine],
+           matcherAccepts(matcher, "babb") ? "true" : "false");
+    LanguageSummary *summary = &matcher->summary;
+    printf("Summary: min length %zu, max length %s, 'b' required: %s, 'c' forbidden: %s\n",
+           summary->min_length, summary->max_length == SUMMARY_UNBOUNDED ? "unbounded" : "bounded",
+           byteSetTest(summary->required, 'b') ? "true" : "false",
+           byteSetTest(summary->forbidden, 'c') ? "true" : "false");
+    printf("Summary pre-check on 'abab': %s\n",
+           summaryMayAccept(summary, "abab", 4) ? "may accept" : "rejected");
+    freeMatcher(matcher);
+
+    // Match a batch of inputs with one bit-sliced pass
+    BitNFA sliced;
+    buildBitNFA(&fsa, &sliced);
+    const char *batch[] = {"abb", "aabb", "babb", "ab", "ba", "abababb", ""};
+    bool batch_results[7];
+    acceptsBitSliced(&sliced, batch, 7, batch_results);
+    printf("Bit-sliced batch:");
+    for (int i = 0; i < 7; i++) {
+        printf(" '%s'=%s", batch[i], batch_results[i] ? "true" : "false");
+    }
+    printf("\n");
+
+    // Same batch with shared prefixes walked once
+    acceptsBatchShared(compiled, batch, 7, batch_results);
+    printf("Prefix-shared batch:");
+    for (int i = 0; i < 7; i++) {
+        printf(" '%s'=%s", batch[i], batch_results[i] ? "true" : "false");
+    }
+    printf("\n");
+
+    // Put a result cache in front of NFA simulation
+    MatchCache *cache = matchCacheCreate(1024);
+    uint64_t version = fsaVersion(&fsa);
+    for (int i = 0; i < 100; i++) {
+        cachedAccepts(cache, matchWithFSA, &fsa, version, i % 2 ? "ababababbabb" : "abab");
+    }
+    uint64_t hits, misses, evictions;
+    matchCacheStats(cache, &hits, &misses, &evictions);
+    printf("\nCache: %llu hits, %llu misses, %llu evictions\n", (unsigned long long)hits,
+           (unsigned long long)misses, (unsigned long long)evictions);
+    freeMatchCache(cache);
+
+    // Extract key and value from ([ab]*)=([ab]*) with a one-pass DFA
+    FSA pair;
+    initFSA(&pair);
+    for (int i = 0; i <= 5; i++) {
+        addState(&pair, i, i == 0, i == 5);
+    }
+    addCaptureTransition(&pair, 0, 1, 0);
+    addTransition(&pair, 1, 1, 'a');
+    addTransition(&pair, 1, 1, 'b');
+    addCaptureTransition(&pair, 1, 2, 1);
+    addTransition(&pair, 2, 3, '=');
+    addCaptureTransition(&pair, 3, 4, 2);
+    addTransition(&pair, 4, 4, 'a');
+    addTransition(&pair, 4, 4, 'b');
+    addCaptureTransition(&pair, 4, 5, 3);
+    OnePassDFA *onepass = buildOnePass(&pair);
+    long slots[MAX_CAPTURE_SLOTS];
+    if (onepass != NULL && onePassCaptures(onepass, "ab=bba", slots)) {
+        printf("\nOne-pass captures in 'ab=bba': key [%ld,%ld), value [%ld,%ld)\n",
+               slots[0], slots[1], slots[2], slots[3]);
+    }
+    freeOnePass(onepass);
+    onepass = buildOnePass(&fsa);
+    printf("Original FSA is one-pass: %s\n", onepass != NULL ? "true" : "false");
+    freeOnePass(onepass);
+
+    // Record latency of repeated accepts calls
+    printf("\nLatency histograms:\n");
+    latencyEnable(true);
+    for (int i = 0; i < 1000; i++) {
+        accepts(&fsa, "abb");
+        accepts(&fsa, "ababababababbabb");
+        acceptsCompiled(compiled, "ababababababbabb");
+    }
+    latencyEnable(false);
+    latencyExport(stdout);
 
+    freeCompiledDFA(ends_b_compiled);
+    freeCompiledDFA(compiled);
     free(dfa);
 
     return 0;